@@ -0,0 +1,349 @@
+#include "Precomputation.h"
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <vector>
+#include <array>
+
+// the odd primes up to bound, sieve of Eratosthenes on odd numbers
+static std::vector< uint64_t > odd_primes_up_to( uint64_t bound )
+{
+    std::vector< uint64_t > odd_primes;
+    std::vector< bool > is_composite( bound/2 + 1, false );
+    for( uint64_t i = 3; i <= bound; i += 2 )
+    {
+        if( is_composite[ i/2 ] ) { continue; }
+        odd_primes.push_back( i );
+        for( uint64_t j = i*i; j <= bound; j += 2*i ) { is_composite[ j/2 ] = true; }
+    }
+    return odd_primes;
+}
+
+std::vector< uint64_t > precomputation_primes( uint64_t count )
+{
+    // the m-th prime is below m( log m + log log m ) for m >= 6, here m = count + 1 with 2 left out
+    double m = count + 1;
+    uint64_t bound = ( m < 6 ) ? 13 : (uint64_t) ( m*( log( m ) + log( log( m ) ) ) ) + 1;
+    std::vector< uint64_t > odd_primes = odd_primes_up_to( bound );
+    odd_primes.resize( std::min( (uint64_t) odd_primes.size(), count ) );
+    return odd_primes;
+}
+
+Precomputation::Precomputation( uint64_t init_bound_exponent, uint64_t init_p_exponent, uint64_t init_C_constant )
+{
+    bound_exponent = init_bound_exponent;
+    p_exponent = init_p_exponent;
+    C_constant = init_C_constant;
+
+    // 10^38 is the largest power of 10 below 2^128
+    if( bound_exponent > 38 ) { std::cerr << "B = 10^" << bound_exponent << " does not fit in 128 bits" << std::endl; }
+    bound = 1;
+    for( uint64_t i = 0; i < bound_exponent && i < 38; i++ ) { bound *= 10; }
+}
+
+// x^n, or 2^128 - 1 if that does not fit
+static unsigned __int128 power_saturated( unsigned __int128 x, uint64_t n )
+{
+    unsigned __int128 result = 1;
+    for( uint64_t j = 0; j < n; j++ )
+    {
+        if( __builtin_mul_overflow( result, x, &result ) ) { return ~(unsigned __int128) 0; }
+    }
+    return result;
+}
+
+unsigned __int128 Precomputation::elimination_threshold( uint64_t p )
+{
+    // C = 0 would never eliminate anything
+    if( C_constant == 0 ) { return ~(unsigned __int128) 0; }
+    unsigned __int128 divisor;
+    if( __builtin_mul_overflow( power_saturated( p, p_exponent ), (unsigned __int128) C_constant, &divisor ) ) { return 0; }
+    return bound / divisor;
+}
+
+bool Precomputation::is_eliminated( unsigned __int128 P, unsigned __int128 L, uint64_t p )
+{
+    return exceeds_threshold( P, L, elimination_threshold( p ) );
+}
+
+uint64_t Precomputation::largest_uneliminated( unsigned __int128 P, unsigned __int128 L )
+{
+    // x^n <= floor( B/(P*L*C) ), by the same argument as for the threshold
+    unsigned __int128 PLC;
+    if( __builtin_mul_overflow( P, L, &PLC ) || __builtin_mul_overflow( PLC, (unsigned __int128) C_constant, &PLC ) || PLC > bound ) { return 0; }
+    if( PLC == 0 || p_exponent == 0 ) { return UINT64_MAX; }
+    unsigned __int128 limit = bound / PLC;
+
+    // the floating point root is off by a little at most, the integer steps make it exact
+    double estimate = pow( (double) limit, 1.0 / p_exponent );
+    if( estimate >= 1.8e19 ) { return UINT64_MAX; }
+    uint64_t x = (uint64_t) estimate;
+    while( x > 0 && power_saturated( x, p_exponent ) > limit ) { x--; }
+    while( x < UINT64_MAX && power_saturated( (unsigned __int128) x + 1, p_exponent ) <= limit ) { x++; }
+    return x;
+}
+
+uint64_t Precomputation::append_limit( unsigned __int128 P, uint64_t L, uint64_t R_bound )
+{
+    uint64_t q_max = largest_uneliminated( P, L );
+    uint64_t root = sqrt( (double) R_bound );
+    while( root * root > R_bound ) { root--; }
+    while( ( root + 1 ) * ( root + 1 ) <= R_bound ) { root++; }
+    if( q_max < root && R_bound / L / APPEND_PAST_RULE_RATIO > root ) { q_max = root; }
+    return q_max;
+}
+
+Precomputation::prime_step Precomputation::make_step( uint64_t i )
+{
+    prime_step step = {};
+    step.p = primes[i];
+    step.bit = i + 1;
+    step.masked = ( step.bit < 64*PRECOMPUTATION_MASK_WORDS );
+    if( !step.masked ) { return step; }
+
+    uint64_t m = step.p - 1;
+    for( uint64_t j = 0; m > 1; j++ )
+    {
+        uint64_t q = ( j == 0 ) ? 2 : primes[ j-1 ];
+        if( m % q != 0 ) { continue; }
+        step.mask[ j / 64 ] |= (uint64_t) 1 << ( j % 64 );
+        step.pm1_primes[ step.pm1_len ] = q;
+        step.pm1_bits[ step.pm1_len ] = j;
+        step.pm1_exponents[ step.pm1_len ] = 0;
+        while( m % q == 0 )
+        {
+            m /= q;
+            step.pm1_exponents[ step.pm1_len ]++;
+        }
+        step.pm1_len++;
+    }
+    return step;
+}
+
+bool Precomputation::append( const tree_job& job, const prime_step& step, tree_job& child )
+{
+    child = job;
+    child.b = step.p;
+    if( __builtin_mul_overflow( job.P, (unsigned __int128) step.p, &child.P ) ) { return false; }
+
+    uint64_t lcm_factor = 1;
+    if( !step.masked )
+    {
+        lcm_factor = ( step.p - 1 ) / std::gcd( (uint64_t) ( job.L % ( step.p - 1 ) ), step.p - 1 );
+    }
+    else
+    {
+        // L*(p-1)/gcd( L, p-1 ), a prime q^e of p-1 that L does not have multiplies in whole
+        // otherwise only the part of q^e past q^{v_q(L)}, and v_q(L) is the larger of the two exponents
+        child.primes.P_mask[ step.bit / 64 ] |= (uint64_t) 1 << ( step.bit % 64 );
+        for( uint16_t j = 0; j < step.pm1_len; j++ )
+        {
+            uint64_t q = step.pm1_primes[j];
+            uint16_t bit = step.pm1_bits[j];
+            uint16_t e = step.pm1_exponents[j];
+            if( bit < PRECOMPUTATION_EXPONENT_BITS )
+            {
+                for( uint16_t k = job.primes.L_exponents[ bit ]; k < e; k++ ) { lcm_factor *= q; }
+                child.primes.L_exponents[ bit ] = std::max( (uint16_t) job.primes.L_exponents[ bit ], e );
+            }
+            else if( !( job.primes.L_mask[ bit / 64 ] & ( (uint64_t) 1 << ( bit % 64 ) ) ) ) { lcm_factor *= q; }
+        }
+        for( int w = 0; w < PRECOMPUTATION_MASK_WORDS; w++ ) { child.primes.L_mask[w] |= step.mask[w]; }
+    }
+    return !__builtin_mul_overflow( job.L, (unsigned __int128) lcm_factor, &child.L );
+}
+
+bool Precomputation::build( uint64_t prime_count, bool verbose, uint64_t job_limit )
+{
+    std::vector< tree_job > new_jobs, old_jobs;
+
+    output_jobs.clear();
+    output_primes.clear();
+    overflowed_jobs = 0;
+    if( primes.size() < prime_count ) { primes = precomputation_primes( prime_count ); }
+
+    // The trivial preproduct
+    old_jobs.push_back( { 1, 1, 1, {} } );
+
+    for( uint64_t i = 0; i < prime_count; i ++ )
+    {
+        prime_step step = make_step( i );
+        uint64_t p = step.p;
+        unsigned __int128 threshold = elimination_threshold( p );
+
+        while( !old_jobs.empty() )
+        {
+            const tree_job& job = old_jobs.back();
+
+            if( exceeds_threshold( job.P, job.L, threshold ) )
+            {
+                output_jobs.push_back( { job.P, job.L, job.b }  );
+                output_primes.push_back( job.primes );
+            }
+            else // so current_preproduct is small enough to create more jobs
+            {
+                tree_job skipped = job;
+                skipped.b = p;
+                new_jobs.push_back( skipped );
+
+                // admissibility check to create new preproduct:  no prime of P divides p-1
+                bool admissible;
+                if( step.masked )
+                {
+                    uint64_t common = 0;
+                    for( int w = 0; w < PRECOMPUTATION_MASK_WORDS; w++ ) { common |= job.primes.P_mask[w] & step.mask[w]; }
+                    admissible = ( common == 0 );
+                }
+                else { admissible = ( std::gcd( (uint64_t) ( job.P % ( p - 1 ) ), p - 1 ) == 1 ); }
+
+                tree_job child;
+                if( admissible && append( job, step, child ) ) { new_jobs.push_back( child ); }
+                else if( admissible ) { overflowed_jobs++; }
+            }
+            old_jobs.pop_back();
+        }
+        if( verbose )
+        {
+            std::cout << " The prime " << p << " has " << new_jobs.size() << " working jobs and " << output_jobs.size() << " are output jobs" << std::endl;
+        }
+        if( job_limit != 0 && new_jobs.size() + output_jobs.size() > job_limit )
+        {
+            output_jobs.clear();
+            output_primes.clear();
+            working_jobs.clear();
+            working_primes.clear();
+            return false;
+        }
+        old_jobs = new_jobs;
+        new_jobs.clear();
+    }
+    if( verbose && overflowed_jobs > 0 )
+    {
+        std::cout << " " << overflowed_jobs << " jobs were dropped because P or L passed 2^128" << std::endl;
+    }
+
+    working_jobs.clear();
+    working_primes.clear();
+    for( auto& job : old_jobs )
+    {
+        working_jobs.push_back( { job.P, job.L, job.b } );
+        working_primes.push_back( job.primes );
+    }
+    return true;
+}
+
+void Precomputation::job_factors( const precomputation_job& job, uint64_t* P_primes, uint16_t& P_len,
+                                  uint64_t* L_primes, uint16_t* L_exponents, uint16_t& L_len )
+{
+    unsigned __int128 P = job[0];
+    unsigned __int128 L = job[1];
+
+    // the primes of P are at most b, and those of L are below b
+    uint64_t b = job[2];
+    if( primes.empty() || primes.back() < b ) { primes = odd_primes_up_to( std::max( b, (uint64_t) 997 ) ); }
+
+    // once p^2 > P, what is left of P is 1 or prime
+    P_len = 0;
+    for( uint64_t i = 0; i < primes.size() && P > 1; i++ )
+    {
+        uint64_t p = primes[i];
+        if( (unsigned __int128) p*p > P )
+        {
+            P_primes[ P_len ] = P;
+            P_len++;
+            break;
+        }
+        if( P % p == 0 )
+        {
+            P_primes[ P_len ] = p;
+            P_len++;
+            P /= p;
+        }
+    }
+
+    L_len = 0;
+    if( L == 1 ) { return; }
+    L_primes[0] = 2;
+    L_exponents[0] = 0;
+    while( L % 2 == 0 )
+    {
+        L /= 2;
+        L_exponents[0]++;
+    }
+    L_len = 1;
+    for( uint64_t i = 0; i < primes.size() && L > 1; i++ )
+    {
+        uint64_t q = primes[i];
+        if( (unsigned __int128) q*q > L )
+        {
+            L_primes[ L_len ] = L;
+            L_exponents[ L_len ] = 1;
+            L_len++;
+            break;
+        }
+        if( L % q == 0 )
+        {
+            L_primes[ L_len ] = q;
+            L_exponents[ L_len ] = 0;
+            while( L % q == 0 )
+            {
+                L /= q;
+                L_exponents[ L_len ]++;
+            }
+            L_len++;
+        }
+    }
+}
+
+void Precomputation::job_factors( const precomputation_job& job, const job_primes& bits, uint64_t* P_primes, uint16_t& P_len,
+                                  uint64_t* L_primes, uint16_t* L_exponents, uint16_t& L_len )
+{
+    // bit 0 is 2 and bit i+1 is the i-th precomputation prime
+    const uint16_t mask_bits = 64*PRECOMPUTATION_MASK_WORDS;
+    if( primes.size() < mask_bits - 1 ) { primes = precomputation_primes( mask_bits - 1 ); }
+
+    // the bits of a prime past the bitsets were never set, and then the primes found do not multiply back to P or L
+    unsigned __int128 P = 1, L = 1;
+    P_len = 0;
+    L_len = 0;
+    for( int w = 0; w < PRECOMPUTATION_MASK_WORDS; w++ )
+    {
+        for( uint64_t m = bits.P_mask[w]; m != 0; m &= m - 1 )
+        {
+            uint16_t bit = 64*w + __builtin_ctzll( m );
+            P_primes[ P_len ] = ( bit == 0 ) ? 2 : primes[ bit - 1 ];
+            P *= P_primes[ P_len++ ];
+        }
+    }
+    for( int w = 0; w < PRECOMPUTATION_MASK_WORDS; w++ )
+    {
+        for( uint64_t m = bits.L_mask[w]; m != 0; m &= m - 1 )
+        {
+            uint16_t bit = 64*w + __builtin_ctzll( m );
+            L_primes[ L_len ] = ( bit == 0 ) ? 2 : primes[ bit - 1 ];
+            L_exponents[ L_len ] = ( bit < PRECOMPUTATION_EXPONENT_BITS ) ? bits.L_exponents[ bit ] : 1;
+            for( uint16_t e = 0; e < L_exponents[ L_len ]; e++ ) { L *= L_primes[ L_len ]; }
+            L_len++;
+        }
+    }
+    if( P != job[0] || L != job[1] ) { job_factors( job, P_primes, P_len, L_primes, L_exponents, L_len ); }
+}
+
+void Precomputation::write_jobs( std::ostream& output, const std::vector< precomputation_job >& jobs )
+{
+    // more than enough room:  P and L are 128-bit
+    uint64_t P_primes[ 128 ], L_primes[ 128 ];
+    uint16_t L_exponents[ 128 ];
+    uint16_t P_len, L_len;
+
+    for( auto& job : jobs )
+    {
+        job_factors( job, P_primes, P_len, L_primes, L_exponents, L_len );
+        output << to_string_128( job[0] ) << " " << to_string_128( job[1] ) << " " << (uint64_t) job[2] << " " << P_len;
+        for( int i = 0; i < P_len; i++ ) { output << " " << P_primes[i]; }
+        output << " " << L_len;
+        for( int i = 0; i < L_len; i++ ) { output << " " << L_primes[i] << " " << L_exponents[i]; }
+        output << "\n";
+    }
+}
@@ -0,0 +1,185 @@
+#ifndef PRECOMPUTATION_H
+#define PRECOMPUTATION_H
+
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// the precomputation tree is built by deciding, one prime at a time,
+// whether or not that prime divides the preproduct
+// the primes are the odd primes in order, as many as build is asked for
+// the paper uses the first 167 odd primes, 3 through 997
+#define PRECOMPUTATION_PRIME_COUNT 167
+
+// a preproduct appends the primes up to sqrt( R_bound ) past the rule when its progression
+// has more than this many terms for each of those primes, see append_limit
+// a child costs about as much as this many terms of the factor sieve
+#define APPEND_PAST_RULE_RATIO 16
+
+// the first count odd primes
+std::vector< uint64_t > precomputation_primes( uint64_t count );
+
+// a job {P, L, b}
+// P and L are 128-bit so that deeper trees and larger B do not overflow them, B = 10^k for k <= 38
+typedef std::array< unsigned __int128, 3 > precomputation_job;
+
+// decimal digits of n, for writing P and L
+inline std::string to_string_128( unsigned __int128 n )
+{
+    char digits[ 40 ];
+    int i = 40;
+    do
+    {
+        digits[ --i ] = '0' + (int) ( n % 10 );
+        n /= 10;
+    } while( n > 0 );
+    return std::string( digits + i, digits + 40 );
+}
+
+// while the tree is built, each job carries the set of primes dividing P and the set dividing L
+// as bitsets:  bit 0 is 2 and bit i+1 is the i-th precomputation prime
+// the primes dividing p-1 are 2 and precomputation primes below p, so
+//   p is admissible to P:  gcd( P, p-1 ) = 1  exactly when P's set and p-1's set do not meet
+//   lcm( L, p-1 ):  only the primes in both sets need their exponent in L, the rest multiply in whole
+// the bitsets cover the first 64*PRECOMPUTATION_MASK_WORDS - 1 primes, 3 through 1619,
+// and past those build falls back to gcds
+#define PRECOMPUTATION_MASK_WORDS 4
+// the exponent in L of each of the first bits, 2 through 37, is kept next to the bitsets
+// a prime q >= 41 has q^2 > 1619, so it divides p-1 at most once for a masked p
+// and its exponent in L is 1 when its bit is set
+#define PRECOMPUTATION_EXPONENT_BITS 12
+
+// the primes of a job's P and L as build found them, the bitsets above with L's small exponents
+// so that the jobs can be factored without dividing by the precomputation primes, see job_factors
+struct job_primes
+{
+    uint64_t P_mask[ PRECOMPUTATION_MASK_WORDS ];
+    uint64_t L_mask[ PRECOMPUTATION_MASK_WORDS ];
+    uint8_t L_exponents[ PRECOMPUTATION_EXPONENT_BITS ];
+};
+
+// the tree of preproducts that precomputation.cpp builds
+// pulled out into a class so that the autotuner can build the same tree
+// for several choices of the elimination rule
+class Precomputation{
+
+public:
+
+    // The order of the 3-tuple {P, L, b}
+    // P, the preproduct
+    // L = CarmichaelLambda(P)
+    // if n = PR is a CN from a 4-tuple, then the primes dividing R have to exceed b
+    // output_jobs satisfy the elimination rule and are ready for CN_search
+    // working_jobs are what is left when the primes run out
+    std::vector< precomputation_job > output_jobs, working_jobs;
+    // output_primes[i] are the primes of output_jobs[i], and working_primes[i] those of working_jobs[i]
+    std::vector< job_primes > output_primes, working_primes;
+
+    // children dropped by build because their P or L passed 2^128
+    // such a child has P or L above B, so it has no CN
+    uint64_t overflowed_jobs = 0;
+
+    // the elimination rule is of the form P*L*f(p) > B where
+    // f(p) = C*p^n and p is the current prime
+    // B = 10^bound_exponent
+    uint64_t bound_exponent;
+    uint64_t p_exponent;
+    uint64_t C_constant;
+
+    Precomputation( uint64_t init_bound_exponent, uint64_t init_p_exponent, uint64_t init_C_constant );
+
+    // runs the tree over the first prime_count odd primes
+    // if verbose, reports the job counts after each prime like precomputation.cpp always has
+    // a job_limit of 0 means no limit;  otherwise the build gives up and returns false
+    // once more than job_limit jobs are held, since small n can exhaust memory
+    bool build( uint64_t prime_count, bool verbose, uint64_t job_limit = 0 );
+
+    // the rule is decided exactly in integers:  P*L*C*p^n > B  exactly when  P*L > floor( B/(C*p^n) )
+    // so no logarithms, and the same jobs come out on every machine
+    // B <= 10^38 fits in 128 bits
+
+    // floor( B/(C*p^n) ), the threshold for P*L at the prime p, 0 when C*p^n > B
+    // build computes it once per prime
+    unsigned __int128 elimination_threshold( uint64_t p );
+
+    // true if P*L > threshold, also when P*L does not fit in 128 bits
+    static bool exceeds_threshold( unsigned __int128 P, unsigned __int128 L, unsigned __int128 threshold )
+    {
+        unsigned __int128 PL;
+        return __builtin_mul_overflow( P, L, &PL ) || PL > threshold;
+    }
+
+    // true if a preproduct with this P and L is eliminated at the prime p
+    // P and L are 128-bit so that the autotuner can continue the tree
+    // past the point where L fits in a uint64_t
+    bool is_eliminated( unsigned __int128 P, unsigned __int128 L, uint64_t p );
+
+    // the largest x with P*L*C*x^n <= B, so every prime past it eliminates P
+    // 0 if P*L*C > B already, UINT64_MAX if x does not fit
+    uint64_t largest_uneliminated( unsigned __int128 P, unsigned __int128 L );
+
+    // the largest prime Tabulation appends to P, where R_bound = (B-1)/P
+    // largest_uneliminated, except for a preproduct whose progression is long next to sqrt( R_bound ):
+    // that one appends every prime up to sqrt( R_bound ), and then its R is 1 or prime,
+    // which CN_search finds from the divisors of P-1 rather than by stepping through the progression
+    uint64_t append_limit( unsigned __int128 P, uint64_t L, uint64_t R_bound );
+
+    // the factorizations of P and L for a job {P, L, b} of this tree
+    // the primes of P are precomputation primes up to b, and the primes of L divide their p-1,
+    // so both come from dividing by the precomputation primes rather than trial division up to sqrt(P)
+    // P_primes in increasing order, L_primes in increasing order starting with 2 ( L_len = 0 when L = 1 )
+    // the arrays need room for every prime of P and L
+    // checked for B up to 10^23 and n >= 4:  at most 10 primes in P and 8 distinct primes in L
+    void job_factors( const precomputation_job& job, uint64_t* P_primes, uint16_t& P_len,
+                      uint64_t* L_primes, uint16_t* L_exponents, uint16_t& L_len );
+
+    // the same read off the bitsets of the job, with a division only for a job whose primes go past them
+    // bits has to be the job's entry of output_primes or working_primes
+    void job_factors( const precomputation_job& job, const job_primes& bits, uint64_t* P_primes, uint16_t& P_len,
+                      uint64_t* L_primes, uint16_t* L_exponents, uint16_t& L_len );
+
+    // writes one job per line with its factorizations:
+    // P L b P_len p_1 ... p_k L_len q_1 e_1 ... q_m e_m    where L = q_1^e_1 * ... * q_m^e_m
+    void write_jobs( std::ostream& output, const std::vector< precomputation_job >& jobs );
+
+private:
+
+    // B
+    unsigned __int128 bound;
+
+    // the odd primes in order, at least through every prime build or job_factors has needed
+    std::vector< uint64_t > primes;
+
+    // a job of the tree while it is built
+    struct tree_job
+    {
+        unsigned __int128 P, L;
+        uint64_t b;
+        job_primes primes;
+    };
+
+    // the precomputation prime p with its bit and the factorization of p-1
+    // p-1 < 1619 has at most 4 distinct primes
+    // a p past the bitsets is not masked, and build uses gcds for it
+    struct prime_step
+    {
+        uint64_t p;
+        bool masked;
+        uint64_t mask[ PRECOMPUTATION_MASK_WORDS ];         // the primes dividing p-1
+        uint16_t bit;                                       // the bit of p
+        uint16_t pm1_len;
+        uint64_t pm1_primes[ 4 ];
+        uint16_t pm1_bits[ 4 ];
+        uint16_t pm1_exponents[ 4 ];
+    };
+
+    prime_step make_step( uint64_t i );
+
+    // the child of job with p appended, job has to be admissible to p
+    // false if P or L of the child does not fit in 128 bits
+    static bool append( const tree_job& job, const prime_step& step, tree_job& child );
+};
+
+#endif
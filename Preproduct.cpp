@@ -1,30 +1,67 @@
 #include "Preproduct.h"
+#include "telemetry.h"
+#include "montgomery.h"
+#include "results.h"
+#include "placement.h"
+#include "cpu_dispatch.h"
+#include "spsc_ring.h"
 #include <algorithm>
 #include <iostream>
-#include <queue>
 #include <vector>
 #include <cstdint>
 #include <stdio.h>
 #include <gmp.h>
 #include <cstddef>
+#include <numeric>
+#include <cmath>
+#include <memory>
+#include <thread>
+#include <atomic>
 
 static_assert(sizeof(unsigned long) == 8, "unsigned long must be 8 bytes.  needed for mpz's unsigned longs to take 64 bit inputs in various calls.  LP64 model needed ");
 
 // redo these if necessary
 
-// hard code sqrt( B )
-// we have choosen B = 10^24
-#define SQRT_BOUND 1'000'000'000'000
-// largest prime <= sqrt( B / X ) = 10^8
-// because X = 10^8
-#define DEFAULT_MAX_PRIME_BOUND 100'000'000
-// there are 5761455 primes less than 10^8
-#define PRIME_COUNT 5761455
+// primes used to sieve the candidates R in CN_search
+#define CN_SIEVE_PRIME_BOUND 65'536
+// candidates k sieved at a time, a byte each
+#define CN_SIEVE_BLOCK 32'768
+// a sieving prime is only used if it is at most CN_SIEVE_RATIO times the number of candidates
+#define CN_SIEVE_RATIO 16
+// factor_sieve_search takes over from the Fermat tests of CN_search when R <= FACTOR_SEARCH_MAX_R,
+// so its sieving primes are at most FACTOR_SEARCH_PRIME_BOUND = sqrt( FACTOR_SEARCH_MAX_R ),
+// and the progression has at least FACTOR_SEARCH_TERMS_PER_PRIME terms per sieving prime
+// a term costs it a few divisions where the walk pays a Fermat test, but each sieving prime costs an inverse to set up
+// make CPPFLAGS=-DFACTOR_SEARCH_MAX_R=0 leaves every search to the walk
+#ifndef FACTOR_SEARCH_MAX_R
+#define FACTOR_SEARCH_MAX_R 1'000'000'000'000
+#endif
+#define FACTOR_SEARCH_PRIME_BOUND 1'000'000
+#define FACTOR_SEARCH_TERMS_PER_PRIME 1
+#define FACTOR_SEARCH_MIN_TERMS 64
+// CN_search runs as a pipeline of threads when fermat_workers > 0 and there are at least this many candidates
+// e.g. make CPPFLAGS=-DCN_STAGED_MIN_CANDIDATES=1 to put every search in Montgomery arithmetic through it
+#ifndef CN_STAGED_MIN_CANDIDATES
+#define CN_STAGED_MIN_CANDIDATES 1'048'576
+#endif
+// blocks queued for each Fermat worker of the pipeline, 64 KiB each, and pseudoprimes queued from it
+#define CN_STAGED_BLOCK_SLOTS 4
+#define CN_STAGED_PSEUDOPRIME_SLOTS 1024
+// gcds in pollard_brent are taken once per this many steps
+#define BRENT_BATCH 128
+// numbers p-1 factored at a time by primes_admissible_to_P
+#define FACTOR_SIEVE_SEGMENT 65'536
+// a divisor of P-1 costs a few multiplications and a progression term costs a sieve step or a Fermat test,
+// so final_prime_search is used while P-1 has at most this many divisors per term
+#define FINAL_PRIME_DIVISOR_RATIO 4
+// progressions with fewer terms are walked, factoring P-1 would cost more than the walk
+#define FINAL_PRIME_MIN_TERMS 32
 
 Preproduct::Preproduct()
 {
     mpz_init( P ) ;
     mpz_init( L ) ;
+    fermat_workers = 0;
 }
 
 Preproduct::~Preproduct()
@@ -37,152 +74,165 @@ Preproduct::~Preproduct()
 // 1) does not check that init_preproduct is cylic 
 // 2) does not check that init_LofP is actually CarmichaelLambda( init_preproduct )
 // intended use is initializing from precomputation which only generates valid inputs
-// uses trial division because the intended use case is relatively small initializing preproducts
-// could consider another version that passes in arrays of factors
-// precomputation.cpp would need to be re-written
+// factor_small factors both, so a large prime factor of P or L costs a Pollard-Brent call
+// and not a trial division up to it
+// when the factors are at hand, the other initializing skips this
 void Preproduct::initializing( uint64_t init_preproduct, uint64_t init_LofP, uint64_t init_append_bound )
 {
+    TELEMETRY_PHASE( PHASE_INITIALIZING );
     mpz_set_ui( P, init_preproduct );
     mpz_set_ui( L, init_LofP );
     append_bound = init_append_bound;
-    P_len = 0;
 
-       
-    uint64_t temp;
     // set primes array for P
-    if( init_preproduct != 1 )
+    // P is squarefree, so the exponents are all 1
+    uint16_t P_exponents[ MAX_PRIME_FACTORS ];
+    P_len = factor_small( init_preproduct, P_primes, P_exponents );
+
+    // set primes and exponent arrays for L
+    // L_distinct_primes[0] is 2 whenever L > 1 since L is even
+    L_len = factor_small( init_LofP, L_distinct_primes, L_exponents );
+
+    split_L();
+    cursor.len_appended_primes = 0;
+}
+
+// assumes valid inputs, as the other initializing does
+// copies the factors instead of recovering them
+void Preproduct::initializing( unsigned __int128 init_preproduct, unsigned __int128 init_LofP, uint64_t init_append_bound,
+                               const uint64_t* init_P_primes, uint16_t init_P_len,
+                               const uint64_t* init_L_primes, const uint16_t* init_L_exponents, uint16_t init_L_len )
+{
+    TELEMETRY_PHASE( PHASE_INITIALIZING );
+    mpz_set_uint128( P, init_preproduct );
+    mpz_set_uint128( L, init_LofP );
+    append_bound = init_append_bound;
+
+    P_len = init_P_len;
+    std::copy( init_P_primes, init_P_primes + init_P_len, P_primes );
+
+    L_len = init_L_len;
+    std::copy( init_L_primes, init_L_primes + init_L_len, L_distinct_primes );
+    std::copy( init_L_exponents, init_L_exponents + init_L_len, L_exponents );
+
+    split_L();
+    cursor.len_appended_primes = 0;
+}
+
+// the primes of L_small_exponents, and the index of each of them in it
+static const uint64_t L_small_primes[ L_SMALL_PRIMES ] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53 };
+struct small_prime_lanes
+{
+    uint8_t lane[ L_SMALL_PRIME_MAX + 1 ];
+    constexpr small_prime_lanes() : lane()
     {
-        temp = 1;
-        while( temp*temp < init_preproduct )
-        {
-            temp+= 2;
-            if( ( init_preproduct % temp ) == 0 )
-            {
-                init_preproduct = init_preproduct / temp;
-                P_primes[ P_len ] = temp;
-                P_len++;
-            }
-        }
-        // possible remaining factor
-        if( init_preproduct > 1 )
-        {
-            P_primes[ P_len ] = init_preproduct;
-            P_len++;
-        }
+        for( int i = 0; i < L_SMALL_PRIMES; i++ ) { lane[ L_small_primes[i] ] = i; }
     }
-    
-    // set primes and exponent arrays for L
-    if( init_LofP == 1 ) { L_len = 0; }
-    else
+};
+static constexpr small_prime_lanes L_small_lanes;
+
+void Preproduct::split_L()
+{
+    std::fill( L_small_exponents, L_small_exponents + L_SMALL_PRIMES, 0 );
+    L_large_len = 0;
+    for( int i = 0; i < L_len; i++ )
     {
-        L_len = 1;
-        L_distinct_primes[0] = 2;
-        L_exponents[0] = __builtin_ctzl(init_LofP );
-        init_LofP = ( init_LofP >>  __builtin_ctzl( init_LofP ) );
-        // the prime 2 is now taken care of.  Account for odd primes:
-        temp = 3;
-        while( init_LofP != 1 )
-        {
-            if( init_LofP % temp == 0 )
-            {
-                L_exponents[ L_len ] = 0;
-                L_distinct_primes[ L_len ] = temp;
-                while( init_LofP % temp == 0 )
-                {
-                    L_exponents[ L_len ]++;
-                    init_LofP /= temp;
-                }
-                L_len++;
-            }
-            temp += 2;
-        }
+        if( L_distinct_primes[i] <= L_SMALL_PRIME_MAX ) { L_small_exponents[ L_small_lanes.lane[ L_distinct_primes[i] ] ] = L_exponents[i]; }
+        else { L_large_len++; }
     }
-    len_appended_primes = 0;
 }
 
 // assumes prime_stuff is valid and admissible to PP
-void Preproduct::appending( Preproduct PP, primes_stuff p )
+bool Preproduct::appending( const Preproduct& PP, primes_stuff p )
+{
+    return appending( PP, PP.cursor, p );
+}
+
+bool Preproduct::appending( const Preproduct& PP, const admissibility_cursor& PP_cursor, primes_stuff p )
+{
+    TELEMETRY_PHASE( PHASE_APPENDING );
+    return appending_kernel( PP, PP_cursor, p );
+}
+
+CPU_DISPATCH
+bool Preproduct::appending_kernel( const Preproduct& PP, const admissibility_cursor& PP_cursor, primes_stuff p )
 {
     mpz_mul_ui( P, PP.P, p.prime );
     P_len = PP.P_len + 1;
     std::copy( PP.P_primes,PP.P_primes + PP.P_len, P_primes );
-    P_primes[ P_len ] =  p.prime;   
+    P_primes[ PP.P_len ] =  p.prime;   
     append_bound = p.prime;
+    fermat_workers = PP.fermat_workers;
     
-    // initialize L to be PP.L and increase only when new factors are seen
-    // L = PP.L;
-    // if( (PP.L) % (p.prime - 1) == 0 )
+    // L = LCM( PP.L, p-1 ) = PP.L * multiplier, where multiplier divides p-1 < 2^32
+    // so it is built up in 64 bits and L takes a single multiply
+    // p-1 goes into the same split as L:  a vector of exponents on the small primes and a list of large ones
+    uint64_t multiplier = 1;
+    uint8_t pm1_small[ L_SMALL_PRIMES ] = {};
+    uint64_t pm1_large[ L_PRIME_FACTORS ];
+    uint16_t pm1_large_exponents[ L_PRIME_FACTORS ];
+    uint16_t pm1_large_len = 0;
+    for( int j = 0; j < p.pm1_len; j++ )
+    {
+        uint64_t q = p.pm1_distinct_primes[j];
+        uint16_t e = p.pm1_exponents[j];
+        if( q <= L_SMALL_PRIME_MAX )
+        {
+            uint8_t lane = L_small_lanes.lane[q];
+            pm1_small[ lane ] = e;
+            for( int k = PP.L_small_exponents[ lane ]; k < e; k++ ) { multiplier *= q; }
+        }
+        else
+        {
+            pm1_large[ pm1_large_len ] = q;
+            pm1_large_exponents[ pm1_large_len ] = e;
+            pm1_large_len++;
+        }
+    }
 
-    mpz_set( L, PP.L );
-    if( mpz_divisible_ui_p( L, ( p.prime - 1 ) )  )
+    // the small primes:  the exponent of the LCM is the larger of the two, lane by lane
+    // then the primes with a nonzero exponent are written out in order, without branching on them
+    L_len = 0;
+    for( int i = 0; i < L_SMALL_PRIMES; i++ ) { L_small_exponents[i] = std::max( PP.L_small_exponents[i], pm1_small[i] ); }
+    for( int i = 0; i < L_SMALL_PRIMES; i++ )
     {
-        std::copy( PP.L_distinct_primes,PP.L_distinct_primes + PP.L_len, L_distinct_primes );
-        std::copy( PP.L_exponents, PP.L_exponents + PP.L_len, L_exponents );
-        L_len = PP.L_len;
+        L_distinct_primes[ L_len ] = L_small_primes[i];
+        L_exponents[ L_len ] = L_small_exponents[i];
+        L_len += ( L_small_exponents[i] != 0 );
     }
-    else
+
+    // the large primes:  a merge of two short increasing lists
+    const uint64_t* PP_large = PP.L_distinct_primes + PP.L_len - PP.L_large_len;
+    const uint16_t* PP_large_exponents = PP.L_exponents + PP.L_len - PP.L_large_len;
+    uint16_t small_len = L_len;
+    int i = 0;
+    int j = 0;
+    while( i < PP.L_large_len || j < pm1_large_len )
     {
-        //merge L and p-1
-        int i = 0; //counter for PP
-        int j = 0; //counter for p
-        L_len = 0; //counter for P
-        while( i < PP.L_len && j < p.pm1_len )
+        if( L_len == L_MAX_PRIMES ) { return false; }
+        if( j == pm1_large_len || ( i < PP.L_large_len && PP_large[i] < pm1_large[j] ) )
         {
-            // check if they have the same prime
-            if( PP.L_distinct_primes[i] == p.pm1_distinct_primes[j] )
-            {
-                L_distinct_primes[ L_len ] = PP.L_distinct_primes[i];
-                L_exponents[ L_len ] = std::max( PP.L_exponents[i], p.pm1_exponents[j] );
-                //we need to update L if  L_exp < pm1_exp
-                if( PP.L_exponents[i] <  p.pm1_exponents[j])
-                {
-                    for( int L_update = PP.L_exponents[i]; L_update < p.pm1_exponents[j]; L_update++ )
-                    {
-                        // need to import PP.L_distinct_primes[i] before multplying ?
-                        mpz_mul_ui( L, L, PP.L_distinct_primes[i] );
-                        //L *= PP.L_distinct_primes[i];
-                    }
-                }
-                i++; j++; L_len++;
-            }
-            else if( PP.L_distinct_primes[i] < p.pm1_distinct_primes[j] )
-            {
-                L_distinct_primes[ L_len ] = PP.L_distinct_primes[i];
-                L_exponents[ L_len ] = PP.L_exponents[i];
-                i++; L_len++;
-            }
-            else
-            {
-                L_distinct_primes[ L_len ] = p.pm1_distinct_primes[j];
-                L_exponents[ L_len ] = p.pm1_exponents[j];
-                for( int L_update = 0; L_update < p.pm1_exponents[j]; L_update++ )
-                {
-                    mpz_mul_ui( L, L, p.pm1_distinct_primes[j] );
-                    //L *= p.pm1_distinct_primes[j];
-                }
-                j++; L_len++;
-            }
+            L_distinct_primes[ L_len ] = PP_large[i];
+            L_exponents[ L_len ] = PP_large_exponents[i];
+            i++;
         }
-        while( i < PP.L_len )
+        else
         {
-            L_distinct_primes[ L_len ] = PP.L_distinct_primes[i];
-            L_exponents[ L_len ] = PP.L_exponents[i];
-            i++; L_len++;
-        }
-        while( j < p.pm1_len  )
-        {
-            L_distinct_primes[ L_len ] = p.pm1_distinct_primes[j];
-            L_exponents[ L_len ] = p.pm1_exponents[j];
-            for( int L_update = 0; L_update < p.pm1_exponents[j]; L_update++ )
-            {
-                mpz_mul_ui( L, L, p.pm1_distinct_primes[j] );
-                // L *= p.pm1_distinct_primes[j];
-            }
-            j++; L_len++;
+            uint16_t e = pm1_large_exponents[j];
+            uint16_t PP_e = 0;
+            if( i < PP.L_large_len && PP_large[i] == pm1_large[j] ) { PP_e = PP_large_exponents[ i++ ]; }
+            L_distinct_primes[ L_len ] = pm1_large[j];
+            L_exponents[ L_len ] = std::max( e, PP_e );
+            for( int k = PP_e; k < e; k++ ) { multiplier *= pm1_large[j]; }
+            j++;
         }
+        L_len++;
     }
+    L_large_len = L_len - small_len;
+    mpz_mul_ui( L, PP.L, multiplier );
+
     //set appended prime info for further admissibility checks
-    len_appended_primes = PP.len_appended_primes + 1;
+    cursor.len_appended_primes = PP_cursor.len_appended_primes + 1;
     // the next inadmissible prime to p.prime is 2*p.prime + 1 or 4*p.prime + 1
     // case is chosen to avoid divisibility by 3
     uint64_t temp_next_inad = 2*p.prime + 1;
@@ -193,11 +243,11 @@ void Preproduct::appending( Preproduct PP, primes_stuff p )
         temp_mod_3 = 1; 
     }
     
-    if( len_appended_primes == 1 )
+    if( cursor.len_appended_primes == 1 )
     {
-        next_inadmissible[0] = temp_next_inad;
-        mod_three_status[0] = temp_mod_3;
-        appended_primes[0] = p.prime;
+        cursor.next_inadmissible[0] = temp_next_inad;
+        cursor.mod_three_status[0] = temp_mod_3;
+        cursor.appended_primes[0] = p.prime;
     }
     // So, we have an arry in sorted order and we need to insert a new element
     // copy the info from PP into the new product until we find where the new info goes
@@ -206,40 +256,42 @@ void Preproduct::appending( Preproduct PP, primes_stuff p )
     else
     {
         int i = 0;
-        while( PP.next_inadmissible[i] < temp_next_inad && i < PP.len_appended_primes )
+        while( PP_cursor.next_inadmissible[i] < temp_next_inad && i < PP_cursor.len_appended_primes )
         {
-            next_inadmissible[i] = PP.next_inadmissible[i];
-            mod_three_status[i] = PP.mod_three_status[i];
-            appended_primes[i] = PP.appended_primes[i];
+            cursor.next_inadmissible[i] = PP_cursor.next_inadmissible[i];
+            cursor.mod_three_status[i] = PP_cursor.mod_three_status[i];
+            cursor.appended_primes[i] = PP_cursor.appended_primes[i];
             i++;
         }
-        next_inadmissible[i] = temp_next_inad;
-        mod_three_status[i] = temp_mod_3;
-        appended_primes[i] = p.prime; 
-        while( i < PP.len_appended_primes )
+        cursor.next_inadmissible[i] = temp_next_inad;
+        cursor.mod_three_status[i] = temp_mod_3;
+        cursor.appended_primes[i] = p.prime; 
+        while( i < PP_cursor.len_appended_primes )
         {
-            next_inadmissible[i+1] = PP.next_inadmissible[i];
-            mod_three_status[i+1] = PP.mod_three_status[i];
-            appended_primes[i+1] = PP.appended_primes[i];
+            cursor.next_inadmissible[i+1] = PP_cursor.next_inadmissible[i];
+            cursor.mod_three_status[i+1] = PP_cursor.mod_three_status[i];
+            cursor.appended_primes[i+1] = PP_cursor.appended_primes[i];
             i++;
         }
     }
+    return true;
 }
 
 // admissibility check with no gcd
 // if the while loop is not taken, this will execute with less than 10 instructions
 // assumes len_appended_primes > 0
-bool Preproduct::is_admissible( uint64_t prime_to_append )
+bool admissibility_cursor::is_admissible( uint64_t prime_to_append )
 {
   // if this works how we want it to, this while loop will not be entered often
   while( prime_to_append > next_inadmissible[0] )
   {
+    TELEMETRY_ADD( admissible_slow_steps, 1 );
     // add 2*p or 4*p and avoid divisibility be 3.  Flip the state of mod 3 status.
     next_inadmissible[0] += (appended_primes[0] << mod_three_status[0]);
     mod_three_status[0] = (mod_three_status[0] == 1 ) ? 2 : 1;
     int i= 1;
     // put next_inadmissible in sorted order having increased the first element
-    while( i < len_appended_primes && next_inadmissible[ i-1 ] < next_inadmissible[ i ] )
+    while( i < len_appended_primes && next_inadmissible[ i-1 ] > next_inadmissible[ i ] )
     {
       std::swap( next_inadmissible[ i-1 ], next_inadmissible[ i ] );
       std::swap( appended_primes[ i-1 ], appended_primes[ i ] );
@@ -252,6 +304,254 @@ bool Preproduct::is_admissible( uint64_t prime_to_append )
   return ( prime_to_append < next_inadmissible[0] ) ;
 }
 
+// a*b mod m without overflow
+static inline uint64_t mul_mod( uint64_t a, uint64_t b, uint64_t m )
+{
+    return ( (unsigned __int128) a * b ) % m;
+}
+
+// a^{-1} mod m, assumes gcd( a, m ) = 1 and m < 2^63
+static uint64_t inverse_mod( uint64_t a, uint64_t m )
+{
+    int64_t t = 0, new_t = 1;
+    int64_t r = m, new_r = a % m;
+    while( new_r != 0 )
+    {
+        int64_t q = r / new_r;
+        std::swap( t, new_t );
+        new_t -= q*t;
+        std::swap( r, new_r );
+        new_r -= q*r;
+    }
+    return ( t < 0 ) ? t + m : t;
+}
+
+void batch_inverse( const uint64_t* a, uint64_t* inverses, size_t count, uint64_t m )
+{
+    if( count == 0 ) { return; }
+    if( m == 1 )
+    {
+        std::fill( inverses, inverses + count, 0 );
+        return;
+    }
+    // inverses[i] holds a[0]*...*a[i] mod m for now
+    inverses[0] = a[0] % m;
+    for( size_t i = 1; i < count; i++ ) { inverses[i] = mul_mod( inverses[i-1], a[i] % m, m ); }
+
+    // the one extended gcd of the batch:  inverse holds ( a[0]*...*a[i] )^{-1} going down from i = count-1
+    uint64_t inverse = inverse_mod( inverses[ count - 1 ], m );
+    for( size_t i = count - 1; i > 0; i-- )
+    {
+        // a[i]^{-1} = ( a[0]*...*a[i] )^{-1} * ( a[0]*...*a[i-1] )
+        inverses[i] = mul_mod( inverse, inverses[i-1], m );
+        inverse = mul_mod( inverse, a[i] % m, m );
+    }
+    inverses[0] = inverse;
+}
+
+// is_prime_64 is declared in Preproduct.h, so the clones are this file's own, see cpu_dispatch.h
+CPU_DISPATCH
+static bool prime_test_64( uint64_t n )
+{
+    static const uint64_t bases[ 12 ] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+    if( n < 2 ) { return false; }
+    for( auto b : bases )
+    {
+        if( n % b == 0 ) { return n == b; }
+    }
+
+    // n - 1 = d*2^s with d odd
+    uint64_t d = n - 1;
+    int s = __builtin_ctzl( d );
+    d >>= s;
+
+    for( auto b : bases )
+    {
+        // x = b^d mod n
+        uint64_t x = 1, power = b, e = d;
+        while( e > 0 )
+        {
+            if( e & 1 ) { x = mul_mod( x, power, n ); }
+            power = mul_mod( power, power, n );
+            e >>= 1;
+        }
+        if( x == 1 || x == n - 1 ) { continue; }
+        int j = 1;
+        for( ; j < s; j++ )
+        {
+            x = mul_mod( x, x, n );
+            if( x == n - 1 ) { break; }
+        }
+        if( j == s ) { return false; }
+    }
+    return true;
+}
+
+bool is_prime_64( uint64_t n )
+{
+    return prime_test_64( n );
+}
+
+// a nontrivial factor of the composite n < 2^64
+// Brent's cycle finding, with the differences multiplied together so that
+// a gcd is only taken every BRENT_BATCH steps
+static uint64_t pollard_brent( uint64_t n )
+{
+    if( n % 2 == 0 ) { return 2; }
+    for( uint64_t c = 1; ; c++ )
+    {
+        auto f = [ n, c ]( uint64_t v ) { return (uint64_t) ( ( (unsigned __int128) v * v + c ) % n ); };
+        uint64_t x = 2, y = 2, saved_y = 2, product = 1, g = 1;
+        for( uint64_t r = 1; g == 1; r *= 2 )
+        {
+            x = y;
+            for( uint64_t i = 0; i < r; i++ ) { y = f( y ); }
+            for( uint64_t k = 0; k < r && g == 1; k += BRENT_BATCH )
+            {
+                saved_y = y;
+                for( uint64_t i = 0; i < std::min( (uint64_t) BRENT_BATCH, r - k ); i++ )
+                {
+                    y = f( y );
+                    product = mul_mod( product, ( x > y ) ? x - y : y - x, n );
+                }
+                g = std::gcd( product, n );
+            }
+        }
+        // the batch went past the factor, step through it again one gcd at a time
+        if( g == n )
+        {
+            do
+            {
+                saved_y = f( saved_y );
+                g = std::gcd( ( x > saved_y ) ? x - saved_y : saved_y - x, n );
+            }
+            while( g == 1 );
+        }
+        if( g != n ) { return g; }
+    }
+}
+
+// smallest prime factor of every number up to SPF_TABLE_BOUND, built on first use
+// a thread pinned to a NUMA node reads that node's replica, see placement.h
+typedef std::vector< uint32_t, huge_page_allocator< uint32_t > > spf_vector;
+
+static const spf_vector& spf_table()
+{
+    static const spf_vector table = []()
+    {
+        spf_vector spf( SPF_TABLE_BOUND + 1, 0 );
+        for( uint64_t i = 2; i <= SPF_TABLE_BOUND; i++ )
+        {
+            if( spf[i] != 0 ) { continue; }
+            for( uint64_t j = i; j <= SPF_TABLE_BOUND; j += i )
+            {
+                if( spf[j] == 0 ) { spf[j] = i; }
+            }
+        }
+        return spf;
+    }();
+    static node_replicas< spf_vector > replicas( table );
+    return replicas.local();
+}
+
+uint16_t factor_small( uint64_t n, uint64_t* primes, uint16_t* exponents )
+{
+    // prime factors with multiplicity, at most 63 of them
+    uint64_t found[ 64 ];
+    uint16_t found_len = 0;
+
+    if( n > 1 )
+    {
+        int twos = __builtin_ctzl( n );
+        for( int i = 0; i < twos; i++ ) { found[ found_len++ ] = 2; }
+        n >>= twos;
+    }
+
+    // pieces past the table are split by Pollard-Brent until they are prime or in the table
+    uint64_t pieces[ 64 ];
+    uint16_t pieces_len = 0;
+    if( n > 1 ) { pieces[ pieces_len++ ] = n; }
+    const spf_vector& spf = spf_table();
+    while( pieces_len > 0 )
+    {
+        uint64_t piece = pieces[ --pieces_len ];
+        if( piece <= SPF_TABLE_BOUND )
+        {
+            while( piece > 1 )
+            {
+                found[ found_len++ ] = spf[ piece ];
+                piece /= spf[ piece ];
+            }
+        }
+        else if( is_prime_64( piece ) ) { found[ found_len++ ] = piece; }
+        else
+        {
+            uint64_t d = pollard_brent( piece );
+            pieces[ pieces_len++ ] = d;
+            pieces[ pieces_len++ ] = piece / d;
+        }
+    }
+
+    std::sort( found, found + found_len );
+    uint16_t len = 0;
+    for( uint16_t i = 0; i < found_len; i++ )
+    {
+        if( len > 0 && primes[ len - 1 ] == found[i] ) { exponents[ len - 1 ]++; }
+        else
+        {
+            primes[ len ] = found[i];
+            exponents[ len ] = 1;
+            len++;
+        }
+    }
+    return len;
+}
+
+// a nontrivial divisor of f from the strong Fermat ladders, or 0 if none of them split f
+// strong_results[k] holds b_k^((n-1)/2^e) mod n and f divides n, so x = b_k^((n-1)/2^e) mod f
+// is squared in 64 bits up the ladder:  f can split at gcd( x - 1, f )
+// and at gcd( x^(2^j) + 1, f ) for j = 0, ..., e-1
+// each prime q of a CN shows up at the first rung where x^(2^j) = 1 mod q,
+// so one base nearly always separates all of them
+static uint64_t ladder_divisor( uint64_t f, mpz_t* strong_results, int base_count, int exp_on_2 )
+{
+    for( int k = 0; k < base_count; k++ )
+    {
+        uint64_t x = mpz_fdiv_ui( strong_results[k], f );
+        uint64_t g = std::gcd( ( x == 0 ) ? f - 1 : x - 1, f );
+        if( g > 1 && g < f ) { return g; }
+        for( int j = 0; j < exp_on_2; j++ )
+        {
+            g = std::gcd( x + 1, f );
+            if( g > 1 && g < f ) { return g; }
+            x = mul_mod( x, x, f );
+        }
+    }
+    return 0;
+}
+
+// splits the composite factors of a Fermat pseudoprime n as far as the ladders of
+// the base_count bases in strong_results go, see ladder_divisor
+// pieces are sorted into composite and prime with is_prime_64, and composite pieces are tried again
+// composites that do not split stay on comp_factors
+static void split_factors( factor_stack& comp_factors, factor_stack& prime_factors, mpz_t* strong_results, int base_count, int exp_on_2 )
+{
+    factor_stack unsplit = comp_factors;
+    comp_factors.len = 0;
+
+    while( !unsplit.empty() )
+    {
+        uint64_t f = unsplit.pop();
+        uint64_t g = ladder_divisor( f, strong_results, base_count, exp_on_2 );
+        if( g == 0 ) { comp_factors.push( f ); continue; }
+
+        TELEMETRY_ADD( factor_splits, 1 );
+        is_prime_64( g ) ? prime_factors.push( g ) : unsplit.push( g );
+        is_prime_64( f / g ) ? prime_factors.push( f / g ) : unsplit.push( f / g );
+    }
+    comp_factors.overflowed = comp_factors.overflowed || unsplit.overflowed;
+}
+
 // things to do (in no particular order):
 // Incporate append_bound to reduce the number of modular exponentiations:
 // 1a - incorporate some of the primes less than append_bound into the arithmetic progression:
@@ -259,190 +559,634 @@ bool Preproduct::is_admissible( uint64_t prime_to_append )
 //      Then we can consider (p-1) residue classes modulo p*L
 // 1b - or incorporate a bitvector and sieve by all primes less than append_bound
 //    - this increases storage and we would have to be mindful of cache
+//    - done for the primes up to CN_SIEVE_PRIME_BOUND, a byte per candidate k
 // 1c - do both "a" and "b".
 //    - The sieving interval can be of size 10^8 - which would need to be segmented for cache reasons
 //    - a "segment" can be a subset of an arithemtic progression defined by part 1a
 // 2 - we can probably be more careful with temporary variables and have fewer mpz_init calls
 // 3 - in the if( is_fermat_psp ) branch
-//     3a - data structure choice? queue right now
+//     3a - data structure choice? fixed-capacity factor_stack now
 //     3b - check modular exponentation prior to computing gcd
-// 4 - make sure exit conditions are correct
+//        - the whole ladder b^((n-1)/2^e * 2^j) is now used, squaring mod each factor in 64 bits
 // 5 - remove input bound_on_R and compute w/r/t/ B
-void Preproduct::CN_search( uint64_t bound_on_R )
+void Preproduct::CN_search( uint64_t bound_on_R, result_sink& output ) const
+{
+    // compute r^* = p^{-1} mod L
+    mpz_t r_star;
+    mpz_init( r_star );
+    mpz_invert( r_star, P, L );
+    uint64_t r_star64 = mpz_get_ui( r_star );
+    mpz_clear( r_star );
+
+    CN_search( bound_on_R, r_star64, output );
+}
+
+// the mpz values and factor stacks of the factoring and Korselt stage of CN_search
+struct pseudoprime_scratch
+{
+    mpz_t n;
+    mpz_t strong_exp;       // (n-1)/2^e
+    mpz_t result1;          // b^( (n-1)/(2^e) ) for the first base
+    mpz_t result2;
+    mpz_t base;
+    mpz_t gcd_result;
+    // b^( (n-1)/(2^e) ) for the bases after the first, only needed for pseudoprimes
+    mpz_t other_results[ L_MAX_PRIMES ];
+    factor_stack R_composite_factors;
+    factor_stack R_prime_factors;
+
+    pseudoprime_scratch()
+    {
+        mpz_inits( n, strong_exp, result1, result2, base, gcd_result, nullptr );
+        for( int j = 0; j < L_MAX_PRIMES; j++ ) { mpz_init( other_results[j] ); }
+    }
+    ~pseudoprime_scratch()
+    {
+        mpz_clears( n, strong_exp, result1, result2, base, gcd_result, nullptr );
+        for( int j = 0; j < L_MAX_PRIMES; j++ ) { mpz_clear( other_results[j] ); }
+    }
+};
+
+// strikes the k in [ 0, block_len ) with q | R = r^* + kL for the sieving primes q
+// sieve_next[j] is the first k to strike for sieve_q[j], and is moved on to the next block
+static inline void strike_block( std::vector< uint8_t >& struck, uint64_t block_len,
+                                 const std::vector< uint32_t >& sieve_q, std::vector< uint32_t >& sieve_next )
+{
+    std::fill( struck.begin(), struck.begin() + block_len, 0 );
+    for( size_t j = 0; j < sieve_q.size(); j++ )
+    {
+        uint64_t k = sieve_next[j];
+        for( ; k < block_len; k += sieve_q[j] ) { struck[k] = 1; }
+        sieve_next[j] = k - block_len;
+    }
+}
+
+void Preproduct::CN_search( uint64_t bound_on_R, uint64_t init_r_star, result_sink& output ) const
+{
+    TELEMETRY_PHASE( PHASE_SEARCH );
+    if( final_prime_search( bound_on_R, init_r_star, output ) ) { return; }
+    if( factor_sieve_search( bound_on_R, init_r_star, output ) ) { return; }
+    CN_search_kernel( bound_on_R, init_r_star, output );
+}
+
+CPU_DISPATCH
+void Preproduct::CN_search_kernel( uint64_t bound_on_R, uint64_t init_r_star, result_sink& output ) const
 {
     // there are two arithmetic progressions associated with n = P*R
     // letting r^* = P^{-1} mod L where 0 < r^* < L
     // 1) R = r^* + kL - common difference of L
     // 2) n = PR = Pr^* + kPL - common difference of PL
 
-    
-    mpz_t r_star;
-    mpz_init( r_star );
-    // using r_star as a temporary variable for set-up
-    
-    mpz_set( r_star, P );
-    // it now holds the same value as P
-    mpz_sub_ui( r_star, r_star, 1);
-    // it now holds P-1
-    
+    pseudoprime_scratch s;
+
     // need power of 2 dividing LCM( P-1, L )
     // for the stronger fermat exponent
     // we could dynamically choose for each n
     // but we choose the largest power of 2 that works for all n
     // does this matter?  if so, this needs to be moved to the primary while loop
-    int32_t exp_on_2 = std::min( L_exponents[ 0 ], (uint16_t) mpz_scan1( r_star, 0) );
-    int32_t pow_of_2 = ( 1 << exp_on_2 );
-
-    // compute r^* = p^{-1} mod L
-    // this is the start of  R = (r^* + kL) w/ k = 0
-    // r_star is no longer being used as a temporary variable
-    // it now it holds the correct value
-    mpz_invert(r_star, P, L);
+    mpz_sub_ui( s.gcd_result, P, 1 );
+    int32_t exp_on_2 = std::min( L_exponents[ 0 ], (uint16_t) mpz_scan1( s.gcd_result, 0) );
 
-    // having computed r_star, we now use uint64_t for this quantity
-    uint64_t r_star64;
-    mpz_export( &r_star64, 0, 1, sizeof(uint64_t), 0, 0, r_star);
+    // r^* = p^{-1} mod L is the start of  R = (r^* + kL) w/ k = 0
+    uint64_t r_star64 = init_r_star;
 
-    uint64_t L64;
+    uint64_t L64 = 0;
     mpz_export( &L64, 0, 1, sizeof(uint64_t), 0, 0, L);
-    
+
     // This is the start of n = Pr^* + kPL w/ k = 0
     // so n = Pr^*
-    mpz_t n;
-    mpz_init( n );
-    mpz_mul( n, P, r_star);
-
-    mpz_t strong_exp;
-    mpz_init( strong_exp );
+    mpz_mul_ui( s.n, P, init_r_star );
 
     // common difference for n
     mpz_t PL;
     mpz_init( PL );
     mpz_mul( PL, P, L );
 
-    // will need more bases later
-    // use bases from the prime divisors of L
-    mpz_t base;
-    mpz_init( base );
-
-    // storage for the gcd result
-    mpz_t gcd_result;
-    mpz_init( gcd_result );
-    
-    // storage for the result of the exponentiation
-    // result1 will hold the stronger test
-    // result2 will hold the Fermat test
-    mpz_t result1;
-    mpz_init( result1 );
-    mpz_t result2;
-    mpz_init( result2 );
+    bool is_fermat_psp;
 
-    mpz_t r_factor;
-    mpz_init( r_factor );
+    // the number of candidates R <= bound_on_R
+    uint64_t k_count = ( r_star64 <= bound_on_R ) ? ( bound_on_R - r_star64 ) / L64 + 1 : 0;
 
-    bool is_fermat_psp;
+    // sieve set-up:  R = r^* + kL is divisible by the prime q not dividing L
+    // exactly when k = -r^* L^{-1} mod q
+    // a prime much larger than k_count rarely strikes a candidate and still costs an inverse
+    static const std::vector< uint32_t > small_primes = sieve_primes( 2, CN_SIEVE_PRIME_BOUND );
+    std::vector< uint32_t > sieve_q;
+    std::vector< uint32_t > sieve_next;   // the next k to strike, relative to the current block
+    for( auto q : small_primes )
+    {
+        if( q > append_bound || q > CN_SIEVE_RATIO * k_count ) { break; }
+        if( L64 % q == 0 ) { continue; }
+        uint64_t minus_r = ( q - r_star64 % q ) % q;
+        sieve_q.push_back( q );
+        sieve_next.push_back( minus_r * inverse_mod( L64 % q, q ) % q );
+    }
+    std::vector< uint8_t > struck( CN_SIEVE_BLOCK );
 
-    std::queue<uint64_t> R_composite_factors;
-    std::vector<uint64_t> R_prime_factors;
+    // the k that n currently corresponds to
+    uint64_t n_k = 0;
 
-    uint64_t temp;
+    // n = P*R below 2^MONTGOMERY_BITS is tested in 128-bit Montgomery arithmetic, see montgomery.h
+    // and the mpz values are only set for the rare pseudoprime
+    // n is odd since L is even and R = P^{-1} mod L
+    bool use_montgomery = mpz_odd_p( P ) && mpz_sizeinbase( P, 2 ) + ( 64 - __builtin_clzl( bound_on_R | 1 ) ) <= MONTGOMERY_BITS;
+    for( int j = 0; j < L_len; j++ ) { use_montgomery = use_montgomery && ( L_distinct_primes[j] >> 32 ) == 0; }
+    uint64_t P_limbs[2] = { 0, 0 };
+    if( use_montgomery ) { mpz_export( P_limbs, 0, -1, sizeof( uint64_t ), 0, 0, P ); }
+    uint128_t P128 = ( (uint128_t) P_limbs[1] << 64 ) | P_limbs[0];
+    montgomery mont;
+    uint128_t strong128;
 
-    // to incorporate small primes not dividing L
-    // loop over those residue here
-    // could set up a space-saving wheel
-    
-    while( r_star64 <= bound_on_R )
+    if( fermat_workers > 0 && use_montgomery && k_count >= CN_STAGED_MIN_CANDIDATES )
     {
-      R_composite_factors.push( r_star64 );
-      R_prime_factors.clear();
+        CN_search_staged( P128, init_r_star, k_count, exp_on_2, sieve_q, sieve_next, output );
+        mpz_clear( PL );
+        return;
+    }
 
-      int i = 0; //counter for fermat_bases
+    for( uint64_t block_start = 0; block_start < k_count; block_start += CN_SIEVE_BLOCK )
+    {
+      uint64_t block_len = std::min( (uint64_t) CN_SIEVE_BLOCK, k_count - block_start );
+      strike_block( struck, block_len, sieve_q, sieve_next );
 
-      do
+      for( uint64_t k = 0; k < block_len; k++ )
       {
-        // set up strong base:  truncated divsion by 2^e means the exponent holds (n-1)/(2^e)
-        mpz_tdiv_q_2exp( strong_exp, n, exp_on_2 );
-        // we use prime divisors of L as the Fermat bases
-        mpz_set_ui( base, L_distinct_primes[ i ] );
-        mpz_powm( result1,  base,  strong_exp, n); // b^( (n-1)/(2^e) )
-        mpz_powm_ui( result2,  result1, pow_of_2, n); // b^( (n-1)/(2^e)) )^(2^e) = b^(n-1)
+        TELEMETRY_ADD( candidates_scanned, 1 );
+        if( struck[k] ) { TELEMETRY_ADD( candidates_sieved, 1 ); continue; }
+
+        r_star64 = init_r_star + ( block_start + k )*L64;
+
+        // move n forward to this candidate in the arithmetic progression
+        if( use_montgomery ) { mont.set_modulus( P128 * r_star64 ); }
+        else
+        {
+          mpz_addmul_ui( s.n, PL, block_start + k - n_k );
+          n_k = block_start + k;
+        }
 
-        is_fermat_psp = ( mpz_cmp_si( result2, 1 ) == 0 );
+        // R = 1 leaves n = P, whose factorization is already known
+        if( r_star64 == 1 )
+        {
+          mpz_set( s.n, P );
+          if( P_len >= 2 && is_CN() ) { output.found( s.n, P_primes, P_len ); }
+          continue;
+        }
+
+        if( use_montgomery )
+        {
+          // we use prime divisors of L as the Fermat bases
+          is_fermat_psp = mont.fermat_test( L_distinct_primes[ 0 ], exp_on_2, strong128 );
+          if( is_fermat_psp )
+          {
+            mpz_set_uint128( s.n, mont.n );
+            mpz_tdiv_q_2exp( s.strong_exp, s.n, exp_on_2 );
+            mpz_set_uint128( s.result1, mont.from_montgomery( strong128 ) );
+          }
+        }
+        else
+        {
+          // set up strong base:  truncated divsion by 2^e means the exponent holds (n-1)/(2^e)
+          mpz_tdiv_q_2exp( s.strong_exp, s.n, exp_on_2 );
+          // we use prime divisors of L as the Fermat bases
+          mpz_set_ui( s.base, L_distinct_primes[ 0 ] );
+          mpz_powm( s.result1, s.base, s.strong_exp, s.n ); // b^( (n-1)/(2^e) )
+          mpz_powm_ui( s.result2, s.result1, 1 << exp_on_2, s.n ); // b^( (n-1)/(2^e)) )^(2^e) = b^(n-1)
+          is_fermat_psp = ( mpz_cmp_si( s.result2, 1 ) == 0 );
+        }
+        TELEMETRY_ADD( fermat_tests[ 0 ], 1 );
 
         // this conditional is not expected to be entered
-        // so the do-while loop is not expected to be invoked
         // most numbers are not Fermat pseudoprimes
-        if( is_fermat_psp )
+        if( is_fermat_psp ) { finish_pseudoprime( r_star64, exp_on_2, use_montgomery ? &mont : nullptr, s, output ); }
+      }
+    }
+
+    mpz_clear( PL );
+}
+
+void Preproduct::finish_pseudoprime( uint64_t R, int32_t exp_on_2, montgomery* mont, pseudoprime_scratch& s, result_sink& output ) const
+{
+    TELEMETRY_PHASE( PHASE_FACTORING );
+    TELEMETRY_ADD( pseudoprimes, 1 );
+    s.R_composite_factors.clear();
+    s.R_prime_factors.clear();
+    is_prime_64( R ) ? s.R_prime_factors.push( R ) : s.R_composite_factors.push( R );
+
+    // the ladder of the first base nearly always splits R completely
+    split_factors( s.R_composite_factors, s.R_prime_factors, &s.result1, 1, exp_on_2 );
+
+    // otherwise the other bases go through the ladder together
+    // a CN is a Fermat psp to every base coprime to it,
+    // so failing any of them rules n out first
+    bool is_fermat_psp = true;
+    if( !s.R_composite_factors.empty() && !s.R_composite_factors.overflowed )
+    {
+      uint128_t strong128;
+      for( int i = 1; i < L_len && is_fermat_psp; i++ )
+      {
+        if( mont != nullptr )
         {
-          int start_size = R_composite_factors.size();
-          // use a for loop to go through all factors that are currently in the queue
-          for( int j = 0; j < start_size; j++ )
-          {
-            // get element out of queue and put into mpz_t
-            // first time through, this is just r_factor will have the value of r_star
-            temp = R_composite_factors.front();
-            R_composite_factors.pop();
-            
-            mpz_set_ui( r_factor, temp );
-              
-            // check gcd before prime testing
-            // result1 holds the algebraic factor assoicated with b^((n-1)/2^e) + 1
-            mpz_add_ui( result1, result1, 1);
-            mpz_gcd( gcd_result, result1, r_factor);
-
-            // check that gcd_result has a nontrivial divisor of r_factor
-            // could probably be a check on result1 = +/- 1 mod n
-            // before computing the gcd
-            if( mpz_cmp(gcd_result, r_factor) < 0 && mpz_cmp_ui(gcd_result, 1) > 0 )
+          is_fermat_psp = mont->fermat_test( L_distinct_primes[ i ], exp_on_2, strong128 );
+          mpz_set_uint128( s.other_results[ i-1 ], mont->from_montgomery( strong128 ) );
+        }
+        else
+        {
+          mpz_set_ui( s.base, L_distinct_primes[ i ] );
+          mpz_powm( s.other_results[ i-1 ], s.base, s.strong_exp, s.n );
+          mpz_powm_ui( s.result2, s.other_results[ i-1 ], 1 << exp_on_2, s.n );
+          is_fermat_psp = ( mpz_cmp_si( s.result2, 1 ) == 0 );
+        }
+        TELEMETRY_ADD( fermat_tests[ std::min( i, TELEMETRY_BASES - 1 ) ], 1 );
+      }
+      if( is_fermat_psp ) { split_factors( s.R_composite_factors, s.R_prime_factors, s.other_results, L_len - 1, exp_on_2 ); }
+    }
+    if( !is_fermat_psp ) { return; }
+
+    // some strange multi-base Fermat pseudoprime - very rare
+    // whatever the bases did not split is finished off directly
+    while( !s.R_composite_factors.empty() )
+    {
+      uint64_t temp = s.R_composite_factors.pop();
+      uint64_t factor = pollard_brent( temp );
+      TELEMETRY_ADD( factor_splits, 1 );
+      is_prime_64( factor ) ? s.R_prime_factors.push( factor ) : s.R_composite_factors.push( factor );
+      is_prime_64( temp / factor ) ? s.R_prime_factors.push( temp / factor ) : s.R_composite_factors.push( temp / factor );
+    }
+
+    // Korselt's criterion for n = P*R
+    // L divides n-1 by the choice of R, so only the primes of R are left to check:
+    // each exceeds append_bound, appears once, and q-1 divides n-1
+    // more prime factors than fit in the stacks rules n out as well
+    std::sort( s.R_prime_factors.begin(), s.R_prime_factors.end() );
+    mpz_sub_ui( s.gcd_result, s.n, 1 );
+    // a CN below B has at most MAX_PRIME_FACTORS prime factors, P's included
+    bool is_korselt = ( P_len + s.R_prime_factors.len >= 2 ) && ( P_len + s.R_prime_factors.len <= MAX_PRIME_FACTORS )
+                   && !s.R_prime_factors.overflowed && !s.R_composite_factors.overflowed;
+    for( uint16_t j = 0; j < s.R_prime_factors.len && is_korselt; j++ )
+    {
+      is_korselt = ( s.R_prime_factors.factors[j] > append_bound )
+                && ( j == 0 || s.R_prime_factors.factors[j] != s.R_prime_factors.factors[j-1] )
+                && mpz_divisible_ui_p( s.gcd_result, s.R_prime_factors.factors[j] - 1 );
+    }
+    if( is_korselt )
+    {
+      // the primes of P are at most append_bound and those of R exceed it, so n's primes are in order
+      uint64_t n_primes[ MAX_PRIME_FACTORS ];
+      std::copy( P_primes, P_primes + P_len, n_primes );
+      std::copy( s.R_prime_factors.begin(), s.R_prime_factors.end(), n_primes + P_len );
+      output.found( s.n, n_primes, P_len + s.R_prime_factors.len );
+    }
+}
+
+// the staged CN_search
+// a block's surviving candidates, k = block_start + offset[j], from the sieve stage to a Fermat worker
+struct candidate_block
+{
+    uint64_t block_start;
+    uint32_t count;                     // CN_STAGED_END to tell the worker there are no more blocks
+    uint16_t offset[ CN_SIEVE_BLOCK ];
+};
+static_assert( CN_SIEVE_BLOCK <= 65'536, "candidate_block keeps the offsets in a block as uint16_t" );
+#define CN_STAGED_END UINT32_MAX
+
+// a candidate R that is a Fermat psp to the first base, with strong = b^( (n-1)/2^e ) in Montgomery form
+struct pseudoprime_candidate
+{
+    uint64_t R;
+    uint128_t strong;
+};
+
+// the queues of one Fermat worker:  blocks in from the sieve stage, pseudoprimes out to the factor stage
+struct fermat_stage
+{
+    spsc_ring< candidate_block, CN_STAGED_BLOCK_SLOTS > blocks;
+    spsc_ring< pseudoprime_candidate, CN_STAGED_PSEUDOPRIME_SLOTS > pseudoprimes;
+    std::atomic< bool > done{ false };
+};
+
+// a Fermat worker:  the first base on each candidate R of its blocks
+// waits for room when the factor stage falls behind
+CPU_DISPATCH
+static void fermat_worker( fermat_stage& stage, uint128_t P128, uint64_t r_star, uint64_t L, uint64_t base, int32_t exp_on_2 )
+{
+    montgomery mont;
+    uint128_t strong128;
+    std::unique_ptr< candidate_block > block( new candidate_block );
+    while( true )
+    {
+        while( !stage.blocks.pop( *block ) ) { std::this_thread::yield(); }
+        if( block->count == CN_STAGED_END ) { break; }
+        for( uint32_t j = 0; j < block->count; j++ )
+        {
+            uint64_t R = r_star + ( block->block_start + block->offset[j] ) * L;
+            mont.set_modulus( P128 * R );
+            if( !mont.fermat_test( base, exp_on_2, strong128 ) ) { continue; }
+            pseudoprime_candidate psp = { R, strong128 };
+            while( !stage.pseudoprimes.push( psp ) ) { std::this_thread::yield(); }
+        }
+    }
+    stage.done.store( true, std::memory_order_release );
+}
+
+void Preproduct::CN_search_staged( unsigned __int128 P128, uint64_t init_r_star, uint64_t k_count, int32_t exp_on_2,
+                                   std::vector< uint32_t >& sieve_q, std::vector< uint32_t >& sieve_next, result_sink& output ) const
+{
+    uint64_t L64 = mpz_get_ui( L );
+    pseudoprime_scratch s;
+    montgomery mont;
+
+    std::unique_ptr< fermat_stage[] > stages( new fermat_stage[ fermat_workers ] );
+    std::vector< std::thread > workers;
+    for( uint16_t w = 0; w < fermat_workers; w++ )
+    {
+        workers.emplace_back( fermat_worker, std::ref( stages[w] ), P128, init_r_star, L64, L_distinct_primes[0], exp_on_2 );
+    }
+
+    // the factor stage, on this thread so that output is only used from here
+    auto drain = [&]()
+    {
+        pseudoprime_candidate psp;
+        for( uint16_t w = 0; w < fermat_workers; w++ )
+        {
+            while( stages[w].pseudoprimes.pop( psp ) )
             {
-              // will need to add a check about a lower bound on these divisors
-              mpz_export( &temp, 0, 1, sizeof(uint64_t), 0, 0, gcd_result);
-              ( mpz_probab_prime_p( gcd_result, 0 ) == 0 ) ? R_composite_factors.push( temp ) : R_prime_factors.push_back( temp );
-              mpz_divexact(gcd_result, r_factor, gcd_result );
-              mpz_export( &temp, 0, 1, sizeof(uint64_t), 0, 0, gcd_result);
-              ( mpz_probab_prime_p( gcd_result, 0 ) == 0 ) ? R_composite_factors.push( temp ) : R_prime_factors.push_back( temp );
+                mont.set_modulus( P128 * psp.R );
+                mpz_set_uint128( s.n, mont.n );
+                mpz_tdiv_q_2exp( s.strong_exp, s.n, exp_on_2 );
+                mpz_set_uint128( s.result1, mont.from_montgomery( psp.strong ) );
+                finish_pseudoprime( psp.R, exp_on_2, &mont, s, output );
             }
-            else // r_factor was not factored, so it is prime or composite
+        }
+    };
+    // hands a block to worker w, running the factor stage while its queue is full
+    auto send = [&]( uint16_t w, const candidate_block& block )
+    {
+        while( !stages[w].blocks.push( block ) )
+        {
+            drain();
+            std::this_thread::yield();
+        }
+    };
+
+    // the sieve stage, handing the blocks round the workers
+    std::vector< uint8_t > struck( CN_SIEVE_BLOCK );
+    std::unique_ptr< candidate_block > block( new candidate_block );
+    uint16_t next_worker = 0;
+    for( uint64_t block_start = 0; block_start < k_count; block_start += CN_SIEVE_BLOCK )
+    {
+        uint64_t block_len = std::min( (uint64_t) CN_SIEVE_BLOCK, k_count - block_start );
+        strike_block( struck, block_len, sieve_q, sieve_next );
+
+        block->block_start = block_start;
+        block->count = 0;
+        for( uint64_t k = 0; k < block_len; k++ )
+        {
+            if( struck[k] ) { continue; }
+            // R = 1 leaves n = P, whose factorization is already known
+            if( init_r_star == 1 && block_start + k == 0 )
             {
-              ( mpz_probab_prime_p( r_factor, 0 ) == 0 ) ? R_composite_factors.push( temp ) : R_prime_factors.push_back( temp );
+                mpz_set( s.n, P );
+                if( P_len >= 2 && is_CN() ) { output.found( s.n, P_primes, P_len ); }
+                continue;
             }
-          }
-          // if R_composite is empty, check n is CN *here*
-          // output lines below are temporary and meant for debugging
-          gmp_printf ("n = %Zd", n);
-          std::cout << " and R = " << r_star64 << " has " << R_composite_factors.size() << " composite factors and " << R_prime_factors.size() << " prime factors." << std::endl;
-          std::cout << "and is a base-" << L_distinct_primes[i] << " Fermat psp." << std::endl;
-        }
-
-        // get next Fermat base
-        i++;
-        // do it again if
-        // the number is a Fermat psp and
-        // R_composite queue is not empty
-        // if i == L_len, we should probably output or factor directly 
-            // could be some strange multi-base Fermat pseudoprime - very rare?
-        // room for improvement here
-      }
-      while( is_fermat_psp && !R_composite_factors.empty() && i < L_len );
+            block->offset[ block->count++ ] = k;
+        }
+        TELEMETRY_ADD( candidates_scanned, block_len );
+        TELEMETRY_ADD( candidates_sieved, std::count( struck.begin(), struck.begin() + block_len, 1 ) );
+        TELEMETRY_ADD( fermat_tests[ 0 ], block->count );
 
-      // empty queue
-      while( !R_composite_factors.empty() ){ R_composite_factors.pop(); }
+        if( block->count > 0 )
+        {
+            send( next_worker, *block );
+            next_worker = ( next_worker + 1 ) % fermat_workers;
+        }
+        drain();
+    }
 
-      // move to next candidate in arithmetic progression for n and R
-      mpz_add( n, n, PL);
-      r_star64 += L64;
+    block->count = CN_STAGED_END;
+    for( uint16_t w = 0; w < fermat_workers; w++ ) { send( w, *block ); }
+    for( uint16_t w = 0; w < fermat_workers; w++ )
+    {
+        while( !stages[w].done.load( std::memory_order_acquire ) )
+        {
+            drain();
+            std::this_thread::yield();
+        }
+        workers[w].join();
+    }
+    drain();
+}
+
+// the number of divisors of P-1 when final_prime_search searches P and L, with P-1 factored, otherwise 0
+// the checks of final_prime_search, shared with CN_search_engine
+static uint64_t final_prime_divisors( uint64_t P64, uint64_t L64, uint64_t append_bound, uint64_t bound_on_R, uint64_t r_star,
+                                      uint64_t* pm1_primes, uint16_t* pm1_exponents, uint16_t& pm1_len )
+{
+    if( P64 < 2 || (unsigned __int128) ( append_bound + 1 ) * ( append_bound + 1 ) <= bound_on_R ) { return 0; }
+    uint64_t k_count = ( r_star <= bound_on_R ) ? ( bound_on_R - r_star ) / L64 + 1 : 0;
+    if( k_count < FINAL_PRIME_MIN_TERMS ) { return 0; }
+
+    pm1_len = factor_small( P64 - 1, pm1_primes, pm1_exponents );
+    uint64_t divisor_count = 1;
+    for( uint16_t j = 0; j < pm1_len; j++ ) { divisor_count *= pm1_exponents[j] + 1; }
+    return ( divisor_count / FINAL_PRIME_DIVISOR_RATIO > k_count ) ? 0 : divisor_count;
+}
+
+bool Preproduct::final_prime_search( uint64_t bound_on_R, uint64_t r_star, result_sink& output ) const
+{
+    if( mpz_sizeinbase( P, 2 ) > 64 || !mpz_fits_ulong_p( L ) ) { return false; }
+    uint64_t P64 = mpz_get_ui( P );
+    uint64_t L64 = mpz_get_ui( L );
+    uint64_t pm1_primes[ 15 ];
+    uint16_t pm1_exponents[ 15 ];
+    uint16_t pm1_len;
+    uint64_t divisor_count = final_prime_divisors( P64, L64, append_bound, bound_on_R, r_star, pm1_primes, pm1_exponents, pm1_len );
+    if( divisor_count == 0 ) { return false; }
+    TELEMETRY_ADD( candidates_scanned, divisor_count );
+
+    mpz_t n;
+    mpz_init( n );
+
+    // R = 1 is the first term when r^* = 1, as in the walk
+    if( r_star == 1 && P_len >= 2 && is_CN() ) { output.found( P, P_primes, P_len ); }
+
+    // the q = d+1 in the progression and past append_bound, each divisor d once by its exponents
+    uint64_t q_min = std::max( r_star, append_bound + 1 );
+    uint64_t r_residue = r_star % L64;
+    uint16_t exponents[ 15 ] = {};
+    uint64_t powers[ 15 ];
+    std::fill( powers, powers + pm1_len, 1 );
+    std::vector< uint64_t > found_q;
+    uint64_t d = 1;
+    while( true )
+    {
+        uint64_t q = d + 1;
+        if( q >= q_min && q <= bound_on_R && q % L64 == r_residue && is_prime_64( q ) ) { found_q.push_back( q ); }
+
+        // the next divisor:  raise the first exponent that can go up and reset the ones below it
+        uint16_t j = 0;
+        while( j < pm1_len && exponents[j] == pm1_exponents[j] )
+        {
+            exponents[j] = 0;
+            powers[j] = 1;
+            j++;
+        }
+        if( j == pm1_len ) { break; }
+        exponents[j]++;
+        powers[j] *= pm1_primes[j];
+        d = 1;
+        for( uint16_t i = 0; i < pm1_len; i++ ) { d *= powers[i]; }
+    }
+
+    // in increasing order, as the walk finds them
+    std::sort( found_q.begin(), found_q.end() );
+    uint64_t n_primes[ MAX_PRIME_FACTORS ];
+    std::copy( P_primes, P_primes + P_len, n_primes );
+    for( auto q : found_q )
+    {
+        if( P_len + 1 > MAX_PRIME_FACTORS ) { break; }
+        n_primes[ P_len ] = q;
+        mpz_mul_ui( n, P, q );
+        output.found( n, n_primes, P_len + 1 );
     }
 
-    mpz_clear( r_star );
     mpz_clear( n );
-    mpz_clear( strong_exp );
-    mpz_clear( PL );
-    mpz_clear( base );
-    mpz_clear( gcd_result );
-    mpz_clear( r_factor );
-    mpz_clear( result1 );
-    mpz_clear( result2 );
-    
+    return true;
+}
+
+// the odd primes up to FACTOR_SEARCH_PRIME_BOUND, the sieving primes of factor_sieve_search
+static const std::vector< uint32_t >& factor_search_primes()
+{
+    static const std::vector< uint32_t > primes = sieve_primes( 2, FACTOR_SEARCH_PRIME_BOUND );
+    return primes;
+}
+
+// the primes up to sqrt( bound_on_R ) when factor_sieve_search searches the progression, otherwise 0
+// the checks of factor_sieve_search, shared with CN_search_engine
+static size_t factor_sieve_prime_count( uint64_t L64, uint64_t bound_on_R, uint64_t r_star )
+{
+    if( bound_on_R > FACTOR_SEARCH_MAX_R || r_star > bound_on_R ) { return 0; }
+    uint64_t k_count = ( bound_on_R - r_star ) / L64 + 1;
+    if( k_count < FACTOR_SEARCH_MIN_TERMS ) { return 0; }
+
+    // the primes up to sqrt( bound_on_R ) leave 1 or one prime of R, and every R is odd as L is even
+    uint64_t root = sqrt( (double) bound_on_R );
+    while( root * root > bound_on_R ) { root--; }
+    while( ( root + 1 ) * ( root + 1 ) <= bound_on_R ) { root++; }
+    const std::vector< uint32_t >& factor_primes = factor_search_primes();
+    size_t prime_count = std::upper_bound( factor_primes.begin(), factor_primes.end(), root ) - factor_primes.begin();
+    return ( k_count < FACTOR_SEARCH_TERMS_PER_PRIME * prime_count ) ? 0 : prime_count;
+}
+
+search_engine Preproduct::CN_search_engine( uint64_t P64, uint64_t L64, uint64_t append_bound, uint64_t bound_on_R, uint64_t r_star,
+                                            uint64_t& work )
+{
+    uint64_t pm1_primes[ 15 ];
+    uint16_t pm1_exponents[ 15 ];
+    uint16_t pm1_len;
+    work = final_prime_divisors( P64, L64, append_bound, bound_on_R, r_star, pm1_primes, pm1_exponents, pm1_len );
+    if( work > 0 ) { return ENGINE_FINAL_PRIME; }
+    work = ( r_star <= bound_on_R ) ? ( bound_on_R - r_star ) / L64 + 1 : 0;
+    return ( factor_sieve_prime_count( L64, bound_on_R, r_star ) > 0 ) ? ENGINE_FACTOR_SIEVE : ENGINE_FERMAT_WALK;
+}
+
+// a sieving prime of factor_sieve_search
+struct factor_search_prime
+{
+    uint32_t q;
+    uint64_t next;      // the next k with q | R, relative to the current block
+    uint64_t P_mod;     // P mod q-1
+};
+
+bool Preproduct::factor_sieve_search( uint64_t bound_on_R, uint64_t r_star, result_sink& output ) const
+{
+    return factor_sieve_kernel( bound_on_R, r_star, output );
+}
+
+CPU_DISPATCH
+bool Preproduct::factor_sieve_kernel( uint64_t bound_on_R, uint64_t r_star, result_sink& output ) const
+{
+    if( !mpz_fits_ulong_p( L ) ) { return false; }
+    uint64_t L64 = mpz_get_ui( L );
+    size_t prime_count = factor_sieve_prime_count( L64, bound_on_R, r_star );
+    if( prime_count == 0 ) { return false; }
+    uint64_t k_count = ( bound_on_R - r_star ) / L64 + 1;
+    const std::vector< uint32_t >& factor_primes = factor_search_primes();
+    TELEMETRY_ADD( candidates_scanned, k_count );
+
+    // q | R = r^* + kL exactly when k = -r^* L^{-1} mod q, and no q dividing L divides R
+    std::vector< factor_search_prime > primes;
+    for( size_t j = 0; j < prime_count; j++ )
+    {
+        uint32_t q = factor_primes[j];
+        if( L64 % q == 0 ) { continue; }
+        uint64_t minus_r = ( q - r_star % q ) % q;
+        primes.push_back( { q, minus_r * inverse_mod( L64 % q, q ) % q, mpz_fdiv_ui( P, q - 1 ) } );
+    }
+
+    mpz_t n;
+    mpz_init( n );
+    std::vector< uint64_t > remaining( CN_SIEVE_BLOCK );
+    std::vector< uint8_t > ruled_out( CN_SIEVE_BLOCK );
+    uint64_t R_primes[ 15 ];
+    uint16_t R_exponents[ 15 ];
+    uint64_t n_primes[ MAX_PRIME_FACTORS ];
+    std::copy( P_primes, P_primes + P_len, n_primes );
+
+    for( uint64_t block_start = 0; block_start < k_count; block_start += CN_SIEVE_BLOCK )
+    {
+        uint64_t block_len = std::min( (uint64_t) CN_SIEVE_BLOCK, k_count - block_start );
+        uint64_t R = r_star + block_start * L64;
+        for( uint64_t k = 0; k < block_len; k++, R += L64 ) { remaining[k] = R; }
+        std::fill( ruled_out.begin(), ruled_out.begin() + block_len, 0 );
+
+        // R is ruled out by a prime up to append_bound, a square factor, or a prime q with q-1 not dividing n-1
+        // q-1 | P*R - 1 is checked from P mod q-1 and R mod q-1
+        for( auto& f : primes )
+        {
+            uint64_t k = f.next;
+            if( f.q <= append_bound )
+            {
+                for( ; k < block_len; k += f.q ) { ruled_out[k] = 1; }
+            }
+            else
+            {
+                for( ; k < block_len; k += f.q )
+                {
+                    if( ruled_out[k] ) { continue; }
+                    R = r_star + ( block_start + k ) * L64;
+                    remaining[k] /= f.q;
+                    ruled_out[k] = ( remaining[k] % f.q == 0 ) || mul_mod( f.P_mod, R % ( f.q - 1 ), f.q - 1 ) != 1;
+                }
+            }
+            f.next = k - block_len;
+        }
+
+        // what is left of R is 1 or a prime past root, which gets the same checks
+        for( uint64_t k = 0; k < block_len; k++ )
+        {
+            if( ruled_out[k] ) { continue; }
+            R = r_star + ( block_start + k ) * L64;
+            uint64_t q = remaining[k];
+            if( R == 1 )
+            {
+                // R = 1 leaves n = P, whose factorization is already known
+                if( P_len >= 2 && is_CN() ) { output.found( P, P_primes, P_len ); }
+                continue;
+            }
+            if( q > 1 && ( q <= append_bound || mul_mod( mpz_fdiv_ui( P, q - 1 ), R % ( q - 1 ), q - 1 ) != 1 ) ) { continue; }
+
+            // a CN:  L | n-1 by the choice of R, and p-1 | n-1 for the primes of R
+            uint16_t R_len = factor_small( R, R_primes, R_exponents );
+            if( P_len + R_len < 2 || P_len + R_len > MAX_PRIME_FACTORS ) { continue; }
+            std::copy( R_primes, R_primes + R_len, n_primes + P_len );
+            mpz_mul_ui( n, P, R );
+            output.found( n, n_primes, P_len + R_len );
+        }
+    }
+
+    mpz_clear( n );
+    return true;
 }
 
 bool Preproduct::appending_is_CN( std::vector< uint64_t >&  primes_to_append )
@@ -484,112 +1228,249 @@ bool Preproduct::appending_is_CN( std::vector< uint64_t >&  primes_to_append )
     return return_val;
 }
 
-std::vector< primes_stuff > Preproduct::primes_admissible_to_P( )
+primes_table Preproduct::primes_admissible_to_P( uint64_t prime_bound )
 {
-    std::vector< primes_stuff > return_vector;
-    
-    // there are 5761455 primes less than 10^8
-    // we set aside the appropriate space
-    // do this or let the space be dynamically allocated based on the computed prime_bound?
-    return_vector.reserve( PRIME_COUNT );
-    
-    // a different way to do the below would be to
-    // test if P > 10^8 first
-    // only when P > 10^8 would prime_bound have a value less than
-    mpz_t sqrt_P;
-    mpz_init( sqrt_P );
-    mpz_sqrt( sqrt_P, P );
-    
-    int64_t prime_bound;
-    mpz_export( &prime_bound, 0, 1, sizeof(uint64_t), 0, 0, sqrt_P);
-    prime_bound = SQRT_BOUND / prime_bound;
-    prime_bound = std::min( prime_bound, (int64_t) DEFAULT_MAX_PRIME_BOUND );
-    
-    /*
-     initialize some kind of factor sieve up to prime_bound
-     use primes dividing P for admissibility checks
-     e.g. for q in the factor sieve make sure 1 != q mod p for each p dividing P
-     write each admissible prime into the prime_stuff struct formate
-     push_back said prime_stuff
-     */
-    
-    mpz_clear( sqrt_P );
+    primes_table return_vector;
+    admissible_primes primes( *this, prime_bound );
+    for( uint64_t i = 0; primes.at( i ) != nullptr; i++ )
+    {
+        return_vector.push_back( *primes.at( i ) );
+        primes.release( i + 1 );
+    }
     return return_vector;
 }
 
-// Check that lambda(P) divides (P-1)
-// consider changing this to int-type return matching how gmp returns
-// and have the same return standard as gmp
-bool Preproduct::is_CN( )
+admissible_primes::admissible_primes( const Preproduct& job, uint64_t init_prime_bound )
 {
-    bool return_val;
-    mpz_sub_ui( P, P, 1);
-    return_val = mpz_divisible_p( P, L );
-    mpz_add_ui( P, P, 1);
-    return return_val;
+    P_len = job.P_len;
+    std::copy( job.P_primes, job.P_primes + job.P_len, P_primes );
+    prime_bound = std::min( init_prime_bound, (uint64_t) DEFAULT_MAX_PRIME_BOUND );
+    next_low = job.append_bound + 1;
+
+    // at most every odd number of the range is admissible
+    // a chunk is a power of two of primes for the index arithmetic, enough for the range or for a huge page
+    uint64_t most_primes = ( next_low <= prime_bound ) ? ( prime_bound - next_low ) / 2 + 1 : 0;
+    uint64_t chunk_primes = std::max( std::min( most_primes, HUGE_PAGE_BYTES / sizeof( primes_stuff ) ), (size_t) 1 );
+    for( chunk_shift = 0; ( (uint64_t) 1 << chunk_shift ) < chunk_primes; chunk_shift++ ) {}
+    chunk_length = (uint64_t) 1 << chunk_shift;
+    chunk_count = most_primes / chunk_length + 1;
+    chunks.reset( new std::atomic< primes_stuff* >[ chunk_count ] );
+    for( uint64_t c = 0; c < chunk_count; c++ ) { chunks[c].store( nullptr, std::memory_order_relaxed ); }
+
+    if( next_low <= prime_bound )
+    {
+        sieving_primes = sieve_primes( 2, (uint64_t) sqrt( (double) prime_bound ) + 1 );
+        sieving_primes.insert( sieving_primes.begin(), 2 );
+        // a segment is never longer than the range
+        uint64_t segment_length = std::min( (uint64_t) FACTOR_SIEVE_SEGMENT, prime_bound - next_low + 1 );
+        is_composite.resize( segment_length );
+        remaining.resize( segment_length );
+        segment.resize( segment_length );
+    }
 }
 
-/* Factor a Fermat pseudoprime n.  Fermat check not performed, just assumed.
-   Prime, composite factors placed into appropriate vectors.
-*/
-void Preproduct::fermat_factor(uint64_t n, std::queue<uint64_t>& comp_factors, std::vector<uint64_t>& prime_factors, mpz_t& strong_result)
+admissible_primes::~admissible_primes()
 {
-    // we are factoring n, so push n onto the composite queue, and clear the prime factors list
-    comp_factors.push( n );
-    prime_factors.clear();
+    drop_below( UINT64_MAX );
+}
 
-    // temp variable to hold the factor pulled off the queue.  Then will be converted to mps_t n_factor.
-    uint64_t temp;
-    mpz_t n_factor;
-    mpz_init( n_factor );
+const primes_stuff* admissible_primes::at( uint64_t i )
+{
+    if( i >= available.load( std::memory_order_acquire ) )
+    {
+        std::lock_guard< std::mutex > guard( lock );
+        while( i >= available.load( std::memory_order_relaxed ) )
+        {
+            if( !sieve_segment() ) { return nullptr; }
+        }
+    }
+    return chunks[ i >> chunk_shift ].load( std::memory_order_relaxed ) + ( i & ( chunk_length - 1 ) );
+}
 
-    // storage for the gcd result
-    mpz_t gcd_result;
-    mpz_init( gcd_result );
-    
-    int start_size = comp_factors.size();
-    // use a for loop to go through all factors that are currently in the queue
-    for( int j = 0; j < start_size; j++ )
-    {
-        // get element out of queue and put into mpz_t
-        // first time through, this is just n
-        temp = comp_factors.front();
-        comp_factors.pop();
-        
-        mpz_set_ui( n_factor, temp );
-          
-        // check gcd before prime testing
-        // strong_result holds the algebraic factor assoicated with b^((n-1)/2^e) + 1
-        mpz_add_ui( strong_result, strong_result, 1);
-        mpz_gcd( gcd_result, strong_result, n_factor);
-        
-        // check that gcd_result has a nontrivial divisor of n_factor
-        // could probably be a check on result1 = +/- 1 mod n
-        // before computing the gcd
-        if( mpz_cmp(gcd_result, n_factor) < 0 && mpz_cmp_ui(gcd_result, 1) > 0 )
+void admissible_primes::release( uint64_t i )
+{
+    // most calls are inside the first chunk left
+    if( ( i >> chunk_shift ) <= first_chunk.load( std::memory_order_relaxed ) ) { return; }
+    std::lock_guard< std::mutex > guard( lock );
+    drop_below( i );
+}
+
+void admissible_primes::claim( uint64_t i )
+{
+    std::lock_guard< std::mutex > guard( lock );
+    claims.insert( i );
+}
+
+void admissible_primes::unclaim( uint64_t i )
+{
+    std::lock_guard< std::mutex > guard( lock );
+    claims.erase( claims.find( i ) );
+    // with no claim left the walk is done, and nothing below what was made is asked for
+    drop_below( claims.empty() ? available.load( std::memory_order_relaxed ) : *claims.begin() );
+}
+
+void admissible_primes::drop_below( uint64_t i )
+{
+    uint64_t c = first_chunk.load( std::memory_order_relaxed );
+    for( ; c < chunk_count && ( c + 1 ) << chunk_shift <= i; c++ )
+    {
+        primes_stuff* chunk = chunks[c].exchange( nullptr, std::memory_order_relaxed );
+        if( chunk == nullptr ) { break; }
+        huge_page_free( chunk, chunk_length * sizeof( primes_stuff ) );
+    }
+    first_chunk.store( c, std::memory_order_relaxed );
+}
+
+CPU_DISPATCH
+bool admissible_primes::sieve_segment()
+{
+    // factor sieve over segments of ( append_bound, prime_bound ]
+    // each segment is sieved for primality with the odd primes up to sqrt( prime_bound )
+    // then for the primes q in it, q-1 has those same primes (and 2) divided out in increasing order
+    // whatever is left of q-1 is 1 or its largest prime factor
+    // a segment with no admissible prime goes on to the next one
+    while( next_low <= prime_bound )
+    {
+        uint64_t low = next_low;
+        uint64_t high = std::min( low + is_composite.size() - 1, prime_bound );
+        uint64_t len = high - low + 1;
+        next_low = high + 1;
+
+        // primality of low, ..., high
+        // even numbers and 1 are marked too, only odd primes are wanted
+        for( uint64_t i = 0; i < len; i++ ) { is_composite[i] = ( ( low + i ) % 2 == 0 ) || ( low + i == 1 ); }
+        for( auto s : sieving_primes )
+        {
+            if( s == 2 ) { continue; }
+            if( (uint64_t) s*s > high ) { break; }
+            uint64_t first = std::max( (uint64_t) s*s, ( ( low + s - 1 ) / s ) * s );
+            for( uint64_t m = first; m <= high; m += s ) { is_composite[ m - low ] = 1; }
+        }
+
+        // factor p-1 for each prime p in the segment
+        // index i holds p = low + i, so p-1 = low - 1 + i
+        for( uint64_t i = 0; i < len; i++ )
+        {
+            remaining[i] = low - 1 + i;
+            segment[i].prime = low + i;
+            segment[i].pm1_len = 0;
+        }
+        for( auto s : sieving_primes )
+        {
+            if( (uint64_t) s*s > high ) { break; }
+            for( uint64_t m = ( ( low - 1 + s - 1 ) / s ) * s; m <= high - 1; m += s )
+            {
+                uint64_t i = m - ( low - 1 );
+                if( is_composite[i] || m == 0 ) { continue; }
+                primes_stuff& q = segment[i];
+                q.pm1_distinct_primes[ q.pm1_len ] = s;
+                q.pm1_exponents[ q.pm1_len ] = 0;
+                while( remaining[i] % s == 0 )
+                {
+                    remaining[i] /= s;
+                    q.pm1_exponents[ q.pm1_len ]++;
+                }
+                q.pm1_len++;
+            }
+        }
+
+        uint64_t count = available.load( std::memory_order_relaxed );
+        uint64_t before = count;
+        for( uint64_t i = 0; i < len; i++ )
         {
-          // will need to add a check about a lower bound on these divisors
-          mpz_export( &temp, 0, 1, sizeof(uint64_t), 0, 0, gcd_result);
-          ( mpz_probab_prime_p( gcd_result, 0 ) == 0 ) ? comp_factors.push( temp ) : prime_factors.push_back( temp );
-          mpz_divexact(gcd_result, n_factor, gcd_result );
-          mpz_export( &temp, 0, 1, sizeof(uint64_t), 0, 0, gcd_result);
-          ( mpz_probab_prime_p( gcd_result, 0 ) == 0 ) ? comp_factors.push( temp ) : prime_factors.push_back( temp );
+            if( is_composite[i] ) { continue; }
+            // use primes dividing P for admissibility checks
+            // e.g. for q in the factor sieve make sure 1 != q mod p for each p dividing P
+            bool admissible = true;
+            for( int j = 0; j < P_len; j++ )
+            {
+                admissible = admissible && ( ( low + i ) % P_primes[j] != 1 );
+            }
+            if( !admissible ) { continue; }
+
+            primes_stuff& q = segment[i];
+            if( remaining[i] > 1 )
+            {
+                q.pm1_distinct_primes[ q.pm1_len ] = remaining[i];
+                q.pm1_exponents[ q.pm1_len ] = 1;
+                q.pm1_len++;
+            }
+            if( ( count & ( chunk_length - 1 ) ) == 0 )
+            {
+                chunks[ count >> chunk_shift ].store( static_cast< primes_stuff* >( huge_page_allocate( chunk_length * sizeof( primes_stuff ) ) ),
+                                                      std::memory_order_relaxed );
+            }
+            chunks[ count >> chunk_shift ].load( std::memory_order_relaxed )[ count & ( chunk_length - 1 ) ] = q;
+            count++;
         }
-        else // n_factor was not factored, so it is prime or composite
+        // the release makes the primes and their chunk visible to at on the other threads
+        available.store( count, std::memory_order_release );
+        if( count > before ) { return true; }
+    }
+    return false;
+}
+
+std::vector< uint32_t > sieve_primes( uint64_t lower_bound, uint64_t upper_bound )
+{
+    std::vector< uint32_t > return_vector;
+    std::vector< bool > is_composite( upper_bound/2 + 1, false );
+    for( uint64_t i = 3; i*i <= upper_bound; i += 2 )
+    {
+        if( !is_composite[ i/2 ] )
         {
-          ( mpz_probab_prime_p( n_factor, 0 ) == 0 ) ? comp_factors.push( temp ) : prime_factors.push_back( temp );
+            for( uint64_t j = i*i; j <= upper_bound; j += 2*i ) { is_composite[ j/2 ] = true; }
         }
     }
-    // if R_composite is empty, check n is CN *here*
-    // output lines below are temporary and meant for debugging
-    gmp_printf ("factoring n = %Zd", n);
-    std::cout << " has " << comp_factors.size() << " composite factors and " << prime_factors.size() << " prime factors." << std::endl;
+    for( uint64_t i = std::max( lower_bound + 1, (uint64_t) 3 ) | 1; i <= upper_bound; i += 2 )
+    {
+        if( !is_composite[ i/2 ] ) { return_vector.push_back( i ); }
+    }
+    return return_vector;
+}
+
+primes_stuff make_primes_stuff( uint32_t p )
+{
+    // p < 10^8 so there are at most L_PRIME_FACTORS primes, see primes_stuff
+    primes_stuff return_val;
+    return_val.prime = p;
+    uint64_t pm1_primes[ 15 ];
+    uint16_t pm1_exponents[ 15 ];
+    return_val.pm1_len = factor_small( p - 1, pm1_primes, pm1_exponents );
+    std::copy( pm1_primes, pm1_primes + return_val.pm1_len, return_val.pm1_distinct_primes );
+    std::copy( pm1_exponents, pm1_exponents + return_val.pm1_len, return_val.pm1_exponents );
+    return return_val;
+}
+
+// Check that lambda(P) divides (P-1)
+// consider changing this to int-type return matching how gmp returns
+// and have the same return standard as gmp
+bool Preproduct::is_CN( ) const
+{
+    // P-1 goes in a temporary so that P is never changed, and other threads can read it meanwhile
+    mpz_t P_minus_1;
+    mpz_init( P_minus_1 );
+    mpz_sub_ui( P_minus_1, P, 1 );
+    bool return_val = mpz_divisible_p( P_minus_1, L );
+    mpz_clear( P_minus_1 );
+    return return_val;
+}
 
-    // need to clear mpz vars
+/* Factor a Fermat pseudoprime n.  Fermat check not performed, just assumed.
+   Prime, composite factors placed into appropriate stacks.
+*/
+void Preproduct::fermat_factor(uint64_t n, factor_stack& comp_factors, factor_stack& prime_factors, mpz_t& strong_result)
+{
+    // we are factoring n, so it is the only factor so far
+    comp_factors.clear();
+    prime_factors.clear();
+    is_prime_64( n ) ? prime_factors.push( n ) : comp_factors.push( n );
+
+    // e as in fermat_test:  2^e exactly divides n-1
+    split_factors( comp_factors, prime_factors, &strong_result, 1, __builtin_ctzl( n - 1 ) );
 }
 
 /* Check whether n is a Fermat pseudoprime to the base b.  Returns bool with this result.
-   Additionally, sets strong_result variable to b^((n-1)/2^e) + 1
+   Additionally, sets strong_result variable to b^((n-1)/2^e)
    Notes this function returns true for prime n.
 */
 bool Preproduct::fermat_test(mpz_t& n, mpz_t& b, mpz_t& strong_result)
@@ -632,55 +1513,3 @@ bool Preproduct::fermat_test(mpz_t& n, mpz_t& b, mpz_t& strong_result)
     
     return is_psp;   
 }
-
-
-int main(void) {
-    
-    Preproduct P0;
-    // P0.initializing( 599266767, 890750, 991 );
-    P0.initializing( 6682828353, 2289560, 13 );
-    
-    std::cout << "LP for this is " << sizeof( unsigned long int ) << std::endl;
-    
-    std::cout << "Initializing P : " ;
-    gmp_printf ("%Zd = ", P0.P );
-    
-    for( int i = 0; i < ( P0.P_len - 1 ); i++)
-    {
-        std::cout << P0.P_primes[i] << " * "  ;       
-    }
-    std::cout << P0.P_primes[P0.P_len - 1 ] << std::endl ;  
-    
-    std::cout << "Initializing Lambda : " ;
-    gmp_printf ("%Zd = ", P0.L );
-    
-    for( int i = 0; i < ( P0.L_len - 1 ); i++)
-    {
-        std::cout << P0.L_distinct_primes[i] << " ^ "  << P0.L_exponents[ i ] << " * "  ;       
-    }
-    std::cout << P0.L_distinct_primes[P0.L_len - 1] << " ^ "  << P0.L_exponents[ P0.L_len - 1 ] << std::endl ;  
-
-    std::cout << "Testing is_fermat\n";
-    mpz_t n;
-    mpz_init(n);
-    mpz_t base;
-    mpz_init(base);
-    mpz_set_ui(base, 2);
-    mpz_t strong_result;
-    mpz_init(strong_result);
-    
-    for(int i = 100; i < 10000; i++){
-        mpz_set_ui(n, i);
-        bool is_psp = P0.fermat_test(n, base, strong_result);
-        if(is_psp && mpz_probab_prime_p( n, 0 ) == 0 ){
-            std::cout << i << " is a pseudoprime\n";
-        }
-    }
-    
-    
-    // P0.CN_search(1873371784);
-    //P0.CN_search(149637241475922);
-    
-    return 0;
-}
-
@@ -6,8 +6,28 @@
 #include <cstdint>
 #include <stdio.h>
 #include <gmp.h>
-#include <queue>
-#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include "huge_pages.h"
+#include "cpu_dispatch.h"
+
+// where CN_search writes the CN it finds, see results.h
+class result_sink;
+// the 128-bit Fermat tests of CN_search, see montgomery.h
+struct montgomery;
+// the mpz values of the factoring stage of CN_search
+struct pseudoprime_scratch;
+
+// the searches CN_search hands a preproduct to, see Preproduct::CN_search_engine
+enum search_engine
+{
+    ENGINE_FINAL_PRIME,     // final_prime_search, its time goes with the divisors of P-1
+    ENGINE_FACTOR_SIEVE,    // factor_sieve_search, with the terms of the progression
+    ENGINE_FERMAT_WALK,     // the sieve and Fermat tests of CN_search, with the terms the sieve leaves
+    SEARCH_ENGINE_COUNT
+};
 
 // we could consider a re-write for L and prime_stuff
 // we could only store the exponent for 2
@@ -40,6 +60,22 @@
 // "merge" computation of lcm( L(P), p-1) would be a bit easier
 #define L_PRIME_FACTORS 8
 
+// L = CarmichaelLambda(P) of a Preproduct has room for this many distinct primes
+// L < 2^64 has at most 15, and the elimination rule keeps L near sqrt( B ) or below, with far fewer
+// appending a prime can add up to L_PRIME_FACTORS new ones, so L needs more room than p-1
+#define L_MAX_PRIMES 16
+
+// the exponents of L on the primes 2, 3, 5, ..., 53 are also kept as a fixed-width vector, one byte per prime,
+// so that appending merges them with p-1 as a max over the vector, see Preproduct::appending
+#define L_SMALL_PRIMES 16
+#define L_SMALL_PRIME_MAX 53
+
+// largest prime <= sqrt( B / X ) = 10^8
+// because X = 10^8
+// primes_admissible_to_P does not go past this bound
+// it also keeps the primes in primes_stuff within the 8 distinct prime factors above
+#define DEFAULT_MAX_PRIME_BOUND 100'000'000
+
 // consider a more compact storage structure
 // see:  https://github.com/sorenson64/soespace/blob/main/soe.h
 // and the paper:  https://arxiv.org/pdf/2406.09150
@@ -53,6 +89,77 @@ struct primes_stuff
     uint16_t pm1_len;
 };
 
+// a list of primes_stuff, up to 5761455 entries of 56 bytes, so it is kept on huge pages
+typedef std::vector< primes_stuff, huge_page_allocator< primes_stuff > > primes_table;
+
+// the factors of R < 2^64 found while factoring a Fermat pseudoprime n = P*R
+// kept inline so that factoring does not touch the heap
+// a CN below B has at most MAX_PRIME_FACTORS prime factors, so an R that needs more room
+// cannot give a CN:  a push onto a full stack is dropped and sets overflowed
+struct factor_stack
+{
+    uint64_t factors[ MAX_PRIME_FACTORS ];
+    uint16_t len = 0;
+    bool overflowed = false;
+
+    void push( uint64_t factor )
+    {
+        if( len < MAX_PRIME_FACTORS ) { factors[ len++ ] = factor; }
+        else { overflowed = true; }
+    }
+    uint64_t pop() { return factors[ --len ]; }
+    bool empty() const { return len == 0; }
+    void clear() { len = 0; overflowed = false; }
+    uint64_t* begin() { return factors; }
+    uint64_t* end() { return factors + len; }
+};
+
+// deterministic Miller-Rabin for 64-bit n
+// the first 12 primes as bases are enough for n < 3.3*10^24
+bool is_prime_64( uint64_t n );
+
+// the smallest prime factor of every number up to this bound is kept in a table
+// and factor_small goes through the table for those, 4 bytes per number
+// e.g. make CPPFLAGS=-DSPF_TABLE_BOUND=16777216
+#ifndef SPF_TABLE_BOUND
+#define SPF_TABLE_BOUND 1'048'576
+#endif
+
+// factors n into its distinct primes, in increasing order, and their exponents
+// returns the number of distinct primes;  the arrays need room for them ( 15 is always enough )
+// table lookups up to SPF_TABLE_BOUND and Pollard-Brent past it
+// used by initializing for both P and L, and by make_primes_stuff
+uint16_t factor_small( uint64_t n, uint64_t* primes, uint16_t* exponents );
+
+// inverses[i] = a[i]^{-1} mod m for count values coprime to m < 2^63
+// Montgomery's trick:  one extended gcd and 3 multiplications per value
+void batch_inverse( const uint64_t* a, uint64_t* inverses, size_t count, uint64_t m );
+
+// odd primes in ( lower_bound, upper_bound ], sieve of Eratosthenes on odd numbers
+std::vector< uint32_t > sieve_primes( uint64_t lower_bound, uint64_t upper_bound );
+
+// factors p-1 into the primes_stuff format that appending expects
+primes_stuff make_primes_stuff( uint32_t p );
+
+// the state of the admissibility checks of a preproduct with appended primes
+// for each appended prime a, the next prime that is 1 mod a and so cannot be appended as well
+// it only moves forward, so the primes have to be asked about in increasing order
+// appending starts the child's from the parent's, and a task of the appending tree
+// keeps its own copy while it walks the children of a shared parent, see Tabulation
+struct admissibility_cursor
+{
+    // in case 2 of initialization below, we count these appended primes
+    uint16_t len_appended_primes;
+    // these arrays are used to avoid gcd computations for admissibility checks
+    // updated assuming primes are tested for admissibility in increasing order
+    uint64_t next_inadmissible[ APPEND_LIMIT ];
+    uint16_t mod_three_status[ APPEND_LIMIT ];  
+    uint64_t appended_primes[ APPEND_LIMIT ];   
+
+    // done with no gcd check
+    bool is_admissible( uint64_t prime_to_append );
+};
+
 class Preproduct{
     
 	
@@ -67,37 +174,63 @@ public:
     // should change L to mpz_t
     // uint64_t L;
     mpz_t L;
-    uint64_t L_distinct_primes[ L_PRIME_FACTORS ];
-    uint16_t L_exponents[ L_PRIME_FACTORS ];   
+    uint64_t L_distinct_primes[ L_MAX_PRIMES ];
+    uint16_t L_exponents[ L_MAX_PRIMES ];   
     uint16_t L_len;
+    // the same L split for the merge in appending:
+    // L_small_exponents[i] is the exponent of the i-th prime, 0 if it does not divide L,
+    // and the L_large_len primes past L_SMALL_PRIME_MAX are the last ones of L_distinct_primes
+    uint8_t L_small_exponents[ L_SMALL_PRIMES ];
+    uint16_t L_large_len;
 
     // two forms of initialization
     // 1) "intializing" preproduct from the precomputation phase
     // 2) "appending" to the initializing product when prime by prime is justified
-    // in case 2, we count these appended primes
-    uint16_t len_appended_primes;
-    // these arrays are used to avoid gcd computations for admissibility checks
-    // updated assuming primes are tested for admissibility in increasing order
-    uint64_t next_inadmissible[ APPEND_LIMIT ];
-    uint16_t mod_three_status[ APPEND_LIMIT ];  
-    uint64_t appended_primes[ APPEND_LIMIT ];   
+    // the admissibility checks of the primes appended in case 2
+    // the only state that changes after the preproduct is made:  apart from is_admissible,
+    // which moves cursor, the member functions below leave a preproduct as it is,
+    // so one that is done being set up can be read by several threads at once
+    admissibility_cursor cursor;
+
+    // threads for the Fermat tests of a long CN_search, 0 to search on the calling thread alone
+    // set on the initializing preproduct and passed on by appending
+    uint16_t fermat_workers;
 
     // constructor and destructor
     Preproduct();
     ~Preproduct();
+    // copies would share the limbs of P and L, so they are not allowed
+    Preproduct( const Preproduct& ) = delete;
+    Preproduct& operator=( const Preproduct& ) = delete;
     
     // initializing call
-    // has to factor init_preproduct and init_LofP
+    // has to factor init_preproduct and init_LofP, see factor_small
     void initializing( uint64_t init_preproduct, uint64_t init_LofP, uint64_t init_append_bound );
+
+    // initializing call when the factors are already known, as they are for the jobs of the precomputation
+    // see Precomputation::job_factors
+    // init_P_primes in increasing order, init_L_primes in increasing order starting with 2
+    void initializing( unsigned __int128 init_preproduct, unsigned __int128 init_LofP, uint64_t init_append_bound,
+                       const uint64_t* init_P_primes, uint16_t init_P_len,
+                       const uint64_t* init_L_primes, const uint16_t* init_L_exponents, uint16_t init_L_len );
     
     // appending call
     // assume we have an admissible prime to append.
     // contains a merge computation of LCM( lambda(PP), p-1 )	
-    void appending( Preproduct PP, primes_stuff p );
+    // PP is taken by reference:  a by-value copy shares the mpz_t limbs of PP
+    // and its destructor would clear them out from under the caller
+    // returns false if the new L has more than L_MAX_PRIMES distinct primes, and the preproduct is then not usable
+    bool appending( const Preproduct& PP, primes_stuff p );
+    // the same, with the admissibility checks continuing from PP_cursor in place of PP.cursor
+    // e.g. a task's own copy, moved on past the primes below p
+    bool appending( const Preproduct& PP, const admissibility_cursor& PP_cursor, primes_stuff p );
+
+    // sets L_small_exponents and L_large_len from L_distinct_primes and L_exponents, for both initializing calls
+    void split_L();
 
     // member functions
     // done with no gcd check
-    bool is_admissible( uint64_t prime_to_append );
+    bool is_admissible( uint64_t prime_to_append ) { return cursor.is_admissible( prime_to_append ); }
 
     // This will compute L and P with gcd computations
     // does *not* create a Preproduct structure
@@ -105,36 +238,161 @@ public:
     // and have this method be void but write output to file
     bool appending_is_CN( std::vector< uint64_t >&  primes_to_append );
     
-    // finds all R = ( P^{-1} mod L ) + k*L satisfying P*R < B
-    // checks that each candidate is a Fermat psuedoprime
+    // finds all R = ( P^{-1} mod L ) + k*L satisfying R <= bound_on_R
+    // whose prime factors all exceed append_bound
+    // candidates with a small prime factor up to append_bound are sieved out first
+    // checks that each remaining candidate is a Fermat psuedoprime
     // uses a stronger Fermat test to factor composite R
     // if R is fully factored (and has passed the Fermat tests)
-    // then P*R is to be checked with Korselt's criterion  NYI
+    // then P*R is checked with Korselt's criterion
+    // each CN found goes to output with its prime factors
     // meant to be called when it is no longer efficient to do prime-by-prime appending 
     // this takes the bound on R as an argument which implies R <= (B/P) < 2^64
     // and that L < 2^64
-    void CN_search( uint64_t bound_on_R );
+    void CN_search( uint64_t bound_on_R, result_sink& output ) const;
+
+    // the same search when r^* = P^{-1} mod L is already known, e.g. from batch_inverse
+    // hands off to final_prime_search when that is cheaper
+    void CN_search( uint64_t bound_on_R, uint64_t r_star, result_sink& output ) const;
+
+    // CN_search as a pipeline, when fermat_workers > 0, n < 2^MONTGOMERY_BITS,
+    // and there are at least CN_STAGED_MIN_CANDIDATES candidates:
+    //   the sieve stage on the calling thread strikes a block of k and hands the survivors to a Fermat worker,
+    //   the fermat_workers threads each test the first base on their blocks in Montgomery arithmetic,
+    //   and the factor stage, back on the calling thread, finishes the rare pseudoprimes with finish_pseudoprime
+    // the stages are joined by bounded single-producer single-consumer queues, see spsc_ring.h,
+    // and a stage with a full queue ahead of it waits, the sieve stage doing factor work meanwhile
+    // CN are found in the order the pseudoprimes come back, not in increasing order
+    void CN_search_staged( unsigned __int128 P128, uint64_t r_star, uint64_t k_count, int32_t exp_on_2,
+                           std::vector< uint32_t >& sieve_q, std::vector< uint32_t >& sieve_next, result_sink& output ) const;
+
+    // the rest of CN_search for a candidate R whose n = P*R is a Fermat psp to the first base:
+    // the other bases, factoring R by the ladders, and Korselt's criterion
+    // s.n = n, s.strong_exp = (n-1)/2^exp_on_2 and s.result1 = b^( (n-1)/2^exp_on_2 ) mod n for the first base b
+    // mont has n as its modulus, or is null when n is too large for it
+    void finish_pseudoprime( uint64_t R, int32_t exp_on_2, montgomery* mont, pseudoprime_scratch& s, result_sink& output ) const;
 
-    // finds all primes that are admissible to P
-    // the intent is that this creates the vector that holds the primes
-    // that are used with the appending method
-    std::vector< primes_stuff > primes_admissible_to_P( );
+    // the search of CN_search for large P, when B/P is small
+    // once ( append_bound + 1 )^2 > bound_on_R, R is 1 or a single prime q, and n = P*q is a CN exactly when
+    // q = r^* mod L and q-1 divides P-1:  Korselt's criterion for q, as P*q - 1 = P*(q-1) + P-1
+    // so the q are found among the divisors d of P-1 as q = d+1, with no Fermat tests at all
+    // returns false, having done nothing, unless R is forced to be 1 or prime, P < 2^64,
+    // and P-1 has fewer than FINAL_PRIME_DIVISOR_RATIO times as many divisors as the progression has terms
+    // two final primes are left to the appending tree, whose children with one more prime end up here
+    bool final_prime_search( uint64_t bound_on_R, uint64_t r_star, result_sink& output ) const;
+
+    // the search of CN_search for small P and L, when the progression is long and R is small
+    // every R = r^* + kL <= bound_on_R is factored by a segmented sieve with the primes up to sqrt( bound_on_R ),
+    // and P*R is a CN when R's primes exceed append_bound, R is squarefree, and p-1 | P*R - 1 for each prime p of R
+    // so there are no Fermat tests, just a few divisions for each prime a term has up to sqrt( bound_on_R )
+    // returns false, having done nothing, unless bound_on_R <= FACTOR_SEARCH_MAX_R
+    // and the progression has enough terms to pay for setting up the sieving primes
+    bool factor_sieve_search( uint64_t bound_on_R, uint64_t r_star, result_sink& output ) const;
+
+    // the search CN_search( bound_on_R, r_star, output ) would hand P, L and append_bound to, without searching,
+    // for cost models such as the autotuner's
+    // work is the number of divisors of P-1 for final_prime_search, and the number of terms of the progression otherwise
+    static search_engine CN_search_engine( uint64_t P64, uint64_t L64, uint64_t append_bound, uint64_t bound_on_R, uint64_t r_star,
+                                           uint64_t& work );
+
+    // finds all primes in ( append_bound, prime_bound ] that are admissible to P
+    // in increasing order with p-1 factored, ready for the appending method
+    // prime_bound is capped at DEFAULT_MAX_PRIME_BOUND
+    // all of them at once, admissible_primes makes them a segment at a time
+    primes_table primes_admissible_to_P( uint64_t prime_bound );
     
     // check that L exactly divides P - 1
     // in the future modify to take filestream?
     // to return true, means we need to output which is the actual goal
-    bool is_CN( );
+    bool is_CN( ) const;
 
     /* Factor a Fermat pseudoprime n.  Fermat check not performed, just assumed.
-       Prime, composite factors placed into appropriate vectors.
+       Prime, composite factors placed into appropriate stacks.
+       strong_result holds b^((n-1)/2^e) with 2^e exactly dividing n-1, as fermat_test leaves it
+       n is split at every rung of b^((n-1)/2^e * 2^j), j = 0, ..., e
     */
-    void fermat_factor(uint64_t n, std::queue<uint64_t>& comp_factors, std::vector<uint64_t>& prime_factors, mpz_t& strong_result);
+    void fermat_factor(uint64_t n, factor_stack& comp_factors, factor_stack& prime_factors, mpz_t& strong_result);
 
     /* Check whether n is a Fermat pseudoprime to the base b.  Returns bool with this result.
-       Additionally, sets strong_result variable to b^((n-1)/2^e) + 1
+       Additionally, sets strong_result variable to b^((n-1)/2^e)
        Note this function returns true for prime n.
     */
     bool fermat_test(mpz_t& n, mpz_t& b, mpz_t& strong_result);
+
+private:
+
+    // the bodies of appending, of the Fermat walk of CN_search, and of factor_sieve_search,
+    // compiled for each x86-64 level, see cpu_dispatch.h
+    // only Preproduct.cpp calls them, where the clones and the resolver of each are
+    bool appending_kernel( const Preproduct& PP, const admissibility_cursor& PP_cursor, primes_stuff p ) CPU_DISPATCH;
+    void CN_search_kernel( uint64_t bound_on_R, uint64_t r_star, result_sink& output ) const CPU_DISPATCH;
+    bool factor_sieve_kernel( uint64_t bound_on_R, uint64_t r_star, result_sink& output ) const CPU_DISPATCH;
+};
+
+// the primes in ( append_bound, prime_bound ] admissible to the P of a job, in increasing order with p-1 factored,
+// made a segment of FACTOR_SIEVE_SEGMENT numbers at a time as they are asked for
+// the appending tree walks them by index:  a node at index i only looks at indices past i,
+// so once the root is past i nothing below it is needed and release drops it
+// memory is the stretch between the root's index and the furthest index asked for, plus one segment,
+// rather than every admissible prime up to prime_bound
+// primes appended below the job are left to is_admissible, which needs the increasing order
+//
+// the primes are kept in chunks of chunk_length, each on huge pages once it is big enough, see huge_pages.h
+// a chunk does not move until it is dropped, so at can be called from several threads at once
+// a parallel walk drops the chunks below the lowest index still claimed by one of its tasks, see claim
+class admissible_primes
+{
+public:
+    // prime_bound is capped at DEFAULT_MAX_PRIME_BOUND
+    admissible_primes( const Preproduct& job, uint64_t prime_bound );
+    ~admissible_primes();
+    admissible_primes( const admissible_primes& ) = delete;
+    admissible_primes& operator=( const admissible_primes& ) = delete;
+
+    // the i-th admissible prime counting from 0, nullptr past prime_bound
+    // the pointer stays valid until release or unclaim drops i
+    const primes_stuff* at( uint64_t i );
+
+    // the primes before index i are not asked for again, for a walk on a single thread
+    void release( uint64_t i );
+
+    // for a walk on several threads:  a task claims the first index it will ask for before it is queued,
+    // and unclaims it once it is done, and the primes below the lowest claim are dropped
+    // a task that queues another claims for it while its own claim still holds
+    void claim( uint64_t i );
+    void unclaim( uint64_t i );
+
+private:
+    uint64_t P_primes[ MAX_PRIME_FACTORS ];
+    uint16_t P_len;
+    uint64_t prime_bound;
+    uint64_t next_low;                      // the first number of the next segment
+    std::vector< uint32_t > sieving_primes; // 2 and the odd primes up to sqrt( prime_bound )
+
+    // chunk c holds the primes from index c*chunk_length on, chunk_length = 2^chunk_shift
+    // chunks[c] is set before available is moved past its primes, so at reads them without the lock
+    uint16_t chunk_shift;
+    uint64_t chunk_length;
+    uint64_t chunk_count;
+    std::unique_ptr< std::atomic< primes_stuff* >[] > chunks;
+    std::atomic< uint64_t > available{ 0 };    // the primes made so far
+    std::atomic< uint64_t > first_chunk{ 0 };  // the chunks before it are dropped
+
+    // held while segments are made and chunks dropped
+    std::mutex lock;
+    std::multiset< uint64_t > claims;
+
+    // buffers of one segment
+    std::vector< uint8_t > is_composite;
+    std::vector< uint32_t > remaining;
+    primes_table segment;
+
+    // appends the admissible primes of the next segment to the chunks, false if there is none
+    // with lock held
+    bool sieve_segment() CPU_DISPATCH;
+
+    // frees the chunks whose primes are all below index i, with lock held
+    void drop_below( uint64_t i );
 };
 
 #endif
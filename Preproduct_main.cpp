@@ -0,0 +1,53 @@
+#include "Preproduct.h"
+#include <iostream>
+#include <gmp.h>
+
+int main(void) {
+    
+    Preproduct P0;
+    // P0.initializing( 599266767, 890750, 991 );
+    P0.initializing( 6682828353, 2289560, 13 );
+    
+    std::cout << "LP for this is " << sizeof( unsigned long int ) << std::endl;
+    
+    std::cout << "Initializing P : " ;
+    gmp_printf ("%Zd = ", P0.P );
+    
+    for( int i = 0; i < ( P0.P_len - 1 ); i++)
+    {
+        std::cout << P0.P_primes[i] << " * "  ;       
+    }
+    std::cout << P0.P_primes[P0.P_len - 1 ] << std::endl ;  
+    
+    std::cout << "Initializing Lambda : " ;
+    gmp_printf ("%Zd = ", P0.L );
+    
+    for( int i = 0; i < ( P0.L_len - 1 ); i++)
+    {
+        std::cout << P0.L_distinct_primes[i] << " ^ "  << P0.L_exponents[ i ] << " * "  ;       
+    }
+    std::cout << P0.L_distinct_primes[P0.L_len - 1] << " ^ "  << P0.L_exponents[ P0.L_len - 1 ] << std::endl ;  
+
+    std::cout << "Testing is_fermat\n";
+    mpz_t n;
+    mpz_init(n);
+    mpz_t base;
+    mpz_init(base);
+    mpz_set_ui(base, 2);
+    mpz_t strong_result;
+    mpz_init(strong_result);
+    
+    for(int i = 100; i < 10000; i++){
+        mpz_set_ui(n, i);
+        bool is_psp = P0.fermat_test(n, base, strong_result);
+        if(is_psp && mpz_probab_prime_p( n, 0 ) == 0 ){
+            std::cout << i << " is a pseudoprime\n";
+        }
+    }
+    
+    
+    // P0.CN_search(1873371784);
+    //P0.CN_search(149637241475922);
+    
+    return 0;
+}
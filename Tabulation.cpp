@@ -0,0 +1,463 @@
+#include "Tabulation.h"
+#include "telemetry.h"
+#include "montgomery.h"
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <numeric>
+
+// output jobs with at most this many candidates R go through scan_progressions
+#define SMALL_PROGRESSION 256
+// candidates Fermat tested at a time by scan_progressions
+// and the primes it sieves them with
+#define SCAN_SIEVE_BOUND 1'024
+#define SCAN_BATCH 1024
+// children of a node walked by one task of the parallel appending tree, bigger ranges are split for stealing
+#define TREE_TASK_CHILDREN 16
+
+// a candidate R of a progression and its n = P*R < B < 2^80
+struct tagged_candidate
+{
+    uint128_t n;
+    uint64_t R;
+    uint32_t job;
+};
+
+// the number of candidates R = r_star + k*L with R <= R_bound
+static uint64_t term_count( const progression& job )
+{
+    return ( job.r_star <= job.R_bound ) ? ( job.R_bound - job.r_star ) / job.L + 1 : 0;
+}
+
+// an odd prime for a divisibility test by multiplication
+struct sieve_divisor
+{
+    uint64_t inverse;
+    uint64_t limit;
+    uint32_t prime;
+};
+
+Tabulation::Tabulation( uint64_t bound_exponent, uint64_t p_exponent, uint64_t C_constant, result_sink& init_output )
+    : rule( bound_exponent, p_exponent, C_constant ), output( init_output )
+{
+    mpz_init( bound );
+    mpz_ui_pow_ui( bound, 10, bound_exponent );
+}
+
+Tabulation::~Tabulation()
+{
+    mpz_clear( bound );
+}
+
+void Tabulation::run_job( unsigned __int128 P, unsigned __int128 L, uint64_t b, const job_primes& primes, uint64_t job_id )
+{
+    output.job_id = job_id;
+    telemetry_job_begin();
+
+    // the factors of P and L come from the bitsets of the precomputation
+    // a deep tree or a large B can give a job more primes than a Preproduct holds
+    uint64_t P_primes[ 128 ], L_primes[ 128 ];
+    uint16_t L_exponents[ 128 ];
+    uint16_t P_len, L_len;
+    rule.job_factors( { P, L, b }, primes, P_primes, P_len, L_primes, L_exponents, L_len );
+    if( P_len > MAX_PRIME_FACTORS || L_len > L_MAX_PRIMES )
+    {
+        std::cerr << "job " << job_id << " with P = " << to_string_128( P ) << " has " << P_len << " primes in P and "
+                  << L_len << " in L, more than a Preproduct holds" << std::endl;
+        return;
+    }
+
+    // shared, as the tasks of a parallel walk read it
+    std::shared_ptr< Preproduct > root = std::make_shared< Preproduct >();
+    root->initializing( P, L, b, P_primes, P_len, L_primes, L_exponents, L_len );
+    root->fermat_workers = fermat_workers;
+
+    // the rule allows appending q while P*L*C*q^n <= B
+    // P = 1 has no L to step through in CN_search, so it appends until q^3 > B instead
+    uint64_t list_bound;
+    // past that, a job with a long progression appends up to sqrt( B/P ), see Precomputation::append_limit
+    mpz_t R_bound;
+    mpz_init( R_bound );
+    mpz_sub_ui( R_bound, bound, 1 );
+    if( ( P >> 64 ) == 0 ) { mpz_fdiv_q_ui( R_bound, R_bound, P ); }
+    if( P == 1 ) { list_bound = cbrt( mpz_get_d( bound ) ) + 1; }
+    else if( ( P >> 64 ) == 0 && ( L >> 64 ) == 0 && mpz_fits_ulong_p( R_bound ) )
+    {
+        list_bound = std::min( rule.append_limit( P, L, mpz_get_ui( R_bound ) ), (uint64_t) DEFAULT_MAX_PRIME_BOUND - 1 ) + 1;
+    }
+    else { list_bound = std::min( rule.largest_uneliminated( P, L ), (uint64_t) DEFAULT_MAX_PRIME_BOUND - 1 ) + 1; }
+    mpz_clear( R_bound );
+    list_bound = std::min( list_bound, (uint64_t) DEFAULT_MAX_PRIME_BOUND );
+
+    admissible_primes admissible( *root, list_bound );
+    if( tree_workers > 0 )
+    {
+        if( !pool ) { pool.reset( new work_stealing_pool( tree_workers ) ); }
+        locked_sink sink( output );
+        sink.job_id = job_id;
+        pool->run( [&]() { visit( root, admissible, list_bound, 0, 0, sink ); } );
+    }
+    else { search( *root, admissible, list_bound, 0, 0 ); }
+    output.job_done( P, L, b );
+}
+
+void Tabulation::run_output_jobs( const std::vector< precomputation_job >& jobs, const std::vector< job_primes >& primes, uint64_t first_job_id )
+{
+    std::vector< size_t > unscannable;
+    std::vector< progression > progressions = make_progressions( jobs, primes, first_job_id, unscannable );
+
+    // most output jobs have P*L close to B and only a few candidates
+    // the few with a long progression and small P are continued past the rule by run_job, see append_limit
+    std::vector< progression > small;
+    for( auto& job : progressions )
+    {
+        uint64_t k_count = term_count( job );
+        if( k_count <= SMALL_PROGRESSION ) { small.push_back( job ); }
+        else if( rule.append_limit( job.P, job.L, job.R_bound ) > job.b ) { run_job( job.P, job.L, job.b, job.primes, job.job_id ); }
+        else { run_progression( job ); }
+    }
+    scan_progressions( small );
+    for( auto i : unscannable ) { run_job( jobs[i][0], jobs[i][1], jobs[i][2], primes[i], first_job_id + i ); }
+}
+
+std::vector< progression > Tabulation::make_progressions( const std::vector< precomputation_job >& jobs, const std::vector< job_primes >& primes,
+                                                          uint64_t first_job_id, std::vector< size_t >& unscannable )
+{
+    std::vector< progression > progressions;
+    progressions.reserve( jobs.size() );
+
+    // group the jobs by L
+    std::vector< size_t > order( jobs.size() );
+    std::iota( order.begin(), order.end(), 0 );
+    std::stable_sort( order.begin(), order.end(), [ &jobs ]( size_t i, size_t j ) { return jobs[i][1] < jobs[j][1]; } );
+
+    mpz_t R_bound;
+    mpz_init( R_bound );
+    std::vector< uint64_t > residues, inverses;
+    for( size_t start = 0; start < order.size(); )
+    {
+        unsigned __int128 L = jobs[ order[ start ] ][1];
+        size_t end = start;
+        while( end < order.size() && jobs[ order[ end ] ][1] == L ) { end++; }
+        if( ( L >> 64 ) != 0 )
+        {
+            for( size_t i = start; i < end; i++ ) { unscannable.push_back( order[i] ); }
+            start = end;
+            continue;
+        }
+
+        residues.clear();
+        for( size_t i = start; i < end; i++ ) { residues.push_back( jobs[ order[i] ][0] % L ); }
+        inverses.resize( residues.size() );
+        batch_inverse( residues.data(), inverses.data(), residues.size(), L );
+
+        for( size_t i = start; i < end; i++ )
+        {
+            const precomputation_job& job = jobs[ order[i] ];
+            // n = P*R < B, so R <= (B-1)/P
+            mpz_sub_ui( R_bound, bound, 1 );
+            if( ( job[0] >> 64 ) == 0 ) { mpz_fdiv_q_ui( R_bound, R_bound, job[0] ); }
+            if( job[0] == 1 || ( job[0] >> 64 ) != 0 || !mpz_fits_ulong_p( R_bound ) ) { unscannable.push_back( order[i] ); }
+            else
+            {
+                progressions.push_back( { first_job_id + order[i], (uint64_t) job[0], (uint64_t) L, (uint64_t) job[2], inverses[ i - start ], mpz_get_ui( R_bound ),
+                                          primes[ order[i] ] } );
+            }
+        }
+        start = end;
+    }
+    mpz_clear( R_bound );
+
+    return progressions;
+}
+
+void Tabulation::run_progression( const progression& job )
+{
+    uint64_t P_primes[ MAX_PRIME_FACTORS ], L_primes[ L_MAX_PRIMES ];
+    uint16_t L_exponents[ L_MAX_PRIMES ];
+    uint16_t P_len, L_len;
+    rule.job_factors( { job.P, job.L, job.b }, job.primes, P_primes, P_len, L_primes, L_exponents, L_len );
+
+    Preproduct root;
+    root.initializing( job.P, job.L, job.b, P_primes, P_len, L_primes, L_exponents, L_len );
+    root.fermat_workers = fermat_workers;
+    output.job_id = job.job_id;
+    telemetry_job_begin();
+
+    mpz_t R_bound;
+    mpz_init_set_ui( R_bound, job.R_bound );
+    if( !is_empty( root, R_bound, job.b + 1 ) ) { root.CN_search( job.R_bound, job.r_star, output ); }
+    mpz_clear( R_bound );
+    output.job_done( job.P, job.L, job.b );
+}
+
+void Tabulation::scan_progressions( const std::vector< progression >& jobs )
+{
+    // the odd primes up to SCAN_SIEVE_BOUND with q^{-1} mod 2^64
+    // q divides R exactly when R*q^{-1} mod 2^64 <= (2^64 - 1)/q
+    static const std::vector< sieve_divisor > divisors = []()
+    {
+        std::vector< sieve_divisor > list;
+        for( auto q : sieve_primes( 2, SCAN_SIEVE_BOUND ) )
+        {
+            // Newton's iteration doubles the correct low bits of the inverse, q*q = 1 mod 8 to start
+            uint64_t inverse = q;
+            for( int i = 0; i < 5; i++ ) { inverse *= 2 - q*inverse; }
+            list.push_back( { inverse, UINT64_MAX / q, q } );
+        }
+        return list;
+    }();
+
+    mpz_t n, n_minus_1, base, result;
+    mpz_init( n );
+    mpz_init( n_minus_1 );
+    mpz_init_set_ui( base, 2 );
+    mpz_init( result );
+    montgomery mont;
+    uint128_t strong_result;
+
+    std::vector< tagged_candidate > batch;
+    batch.reserve( SCAN_BATCH );
+    // the batch holds the candidates of jobs batch_first to j-1, in that order
+    size_t batch_first = 0;
+    // the time each of those jobs took to sieve, for its telemetry record
+    std::vector< uint64_t > sieve_ns;
+    // the R of the job being tested that are Fermat pseudoprimes
+    std::vector< uint64_t > fermat_passed;
+
+    for( size_t j = 0; j <= jobs.size(); j++ )
+    {
+        // the batch is tested when it is full and once more at the end
+        // each job gets its own telemetry record, as from run_progression
+        if( j == jobs.size() || batch.size() + SMALL_PROGRESSION > SCAN_BATCH )
+        {
+            size_t c = 0;
+            for( size_t i = batch_first; i < j; i++ )
+            {
+                output.job_id = jobs[i].job_id;
+                telemetry_job_begin();
+                [[maybe_unused]] size_t first_candidate = c;
+                fermat_passed.clear();
+                {
+                    // the CN_search of finish_candidate times its own phases, so it runs once this one is closed
+                    TELEMETRY_PHASE( PHASE_SEARCH );
+                    for( ; c < batch.size() && batch[c].job == i; c++ )
+                    {
+                        const tagged_candidate& candidate = batch[c];
+                        bool is_fermat_psp;
+                        if( ( candidate.n >> MONTGOMERY_BITS ) == 0 )
+                        {
+                            mont.set_modulus( candidate.n );
+                            is_fermat_psp = mont.fermat_test( 2, 0, strong_result );
+                        }
+                        else
+                        {
+                            mpz_set_uint128( n, candidate.n );
+                            mpz_sub_ui( n_minus_1, n, 1 );
+                            mpz_powm( result, base, n_minus_1, n );
+                            is_fermat_psp = ( mpz_cmp_ui( result, 1 ) == 0 );
+                        }
+                        TELEMETRY_ADD( fermat_tests[ 0 ], 1 );
+                        if( is_fermat_psp ) { fermat_passed.push_back( candidate.R ); }
+                    }
+                }
+                for( auto R : fermat_passed ) { finish_candidate( jobs[i], R ); }
+                // the job was sieved when it joined the batch, its counts and time go in its record here
+                TELEMETRY_ADD( candidates_scanned, term_count( jobs[i] ) );
+                TELEMETRY_ADD( candidates_sieved, term_count( jobs[i] ) - ( c - first_candidate ) );
+                TELEMETRY_ADD( phase_ns[ PHASE_SEARCH ], sieve_ns[ i - batch_first ] );
+                output.job_done( jobs[i].P, jobs[i].L, jobs[i].b );
+            }
+            batch.clear();
+            sieve_ns.clear();
+            batch_first = j;
+        }
+        if( j == jobs.size() ) { break; }
+
+        // the primes of R exceed b, so R is sieved by the primes up to b
+        // a prime dividing L cannot divide R and never strikes, so neither does 2
+        const progression& job = jobs[j];
+        size_t divisor_count = std::upper_bound( divisors.begin(), divisors.end(), job.b,
+                                                 []( uint64_t b, const sieve_divisor& d ) { return b < d.prime; } ) - divisors.begin();
+
+        telemetry_stopwatch sieve_time;
+        uint64_t k_count = term_count( job );
+        for( uint64_t k = 0; k < k_count; k++ )
+        {
+            uint64_t R = job.r_star + k*job.L;
+            bool struck = false;
+            for( size_t i = 0; i < divisor_count && !struck; i++ ) { struck = ( R*divisors[i].inverse <= divisors[i].limit ); }
+            if( !struck ) { batch.push_back( { (uint128_t) job.P * R, R, (uint32_t) j } ); }
+        }
+        sieve_ns.push_back( sieve_time.elapsed_ns() );
+    }
+
+    mpz_clear( n );
+    mpz_clear( n_minus_1 );
+    mpz_clear( base );
+    mpz_clear( result );
+}
+
+void Tabulation::finish_candidate( const progression& job, uint64_t R )
+{
+    uint64_t P_primes[ MAX_PRIME_FACTORS ], L_primes[ L_MAX_PRIMES ];
+    uint16_t L_exponents[ L_MAX_PRIMES ];
+    uint16_t P_len, L_len;
+    rule.job_factors( { job.P, job.L, job.b }, job.primes, P_primes, P_len, L_primes, L_exponents, L_len );
+
+    Preproduct root;
+    root.initializing( job.P, job.L, job.b, P_primes, P_len, L_primes, L_exponents, L_len );
+    root.fermat_workers = fermat_workers;
+    output.job_id = job.job_id;
+    // the progression from R with R as its bound has R as its only candidate
+    root.CN_search( R, R, output );
+}
+
+void Tabulation::search( Preproduct& node, admissible_primes& admissible, uint64_t list_bound, uint64_t start, uint16_t depth )
+{
+    // n = P*R < B, so R <= (B-1)/P
+    mpz_t R_bound;
+    mpz_init( R_bound );
+    mpz_sub_ui( R_bound, bound, 1 );
+    mpz_fdiv_q( R_bound, R_bound, node.P );
+
+    // CN_search needs P > 1, and R and L to fit in a uint64_t
+    bool can_search = ( node.P_len > 0 ) && mpz_fits_ulong_p( R_bound ) && mpz_fits_ulong_p( node.L );
+    // the appended primes past this are eliminated
+    uint64_t q_max = can_search ? rule.append_limit( mpz_get_uint128( node.P ), mpz_get_ui( node.L ), mpz_get_ui( R_bound ) ) : UINT64_MAX;
+
+    uint64_t i = start;
+    if( depth < APPEND_LIMIT && node.P_len < MAX_PRIME_FACTORS )
+    {
+        Preproduct child;
+        const primes_stuff* q_stuff;
+        for( ; ( q_stuff = admissible.at( i ) ) != nullptr; i++ )
+        {
+            uint64_t q = q_stuff->prime;
+            if( q > q_max ) { break; }
+            if( mpz_cmp_ui( R_bound, q ) < 0 || is_empty( node, R_bound, q ) ) { break; }
+            if( node.cursor.len_appended_primes > 0 && !node.is_admissible( q ) ) { continue; }
+            if( !child.appending( node, *q_stuff ) )
+            {
+                gmp_fprintf( stderr, "preproduct P = %Zd times %u has more than %d primes in L\n", node.P, q_stuff->prime, L_MAX_PRIMES );
+                continue;
+            }
+            search( child, admissible, list_bound, i + 1, depth + 1 );
+            // the children of the job only look past i
+            if( depth == 0 ) { admissible.release( i + 1 ); }
+        }
+    }
+
+    // every prime below admissible[i] has been appended, or is inadmissible and cannot divide R
+    const primes_stuff* stop = admissible.at( i );
+    node.append_bound = ( stop != nullptr ) ? stop->prime - 1 : std::max( list_bound, node.append_bound );
+
+    if( !is_empty( node, R_bound, node.append_bound + 1 ) )
+    {
+        if( can_search ) { node.CN_search( mpz_get_ui( R_bound ), output ); }
+        else
+        {
+            gmp_fprintf( stderr, "preproduct P = %Zd with L = %Zd and append bound %lu cannot be searched\n", node.P, node.L, node.append_bound );
+        }
+    }
+
+    mpz_clear( R_bound );
+}
+
+void Tabulation::visit( std::shared_ptr< Preproduct > node, admissible_primes& admissible, uint64_t list_bound, uint64_t start, uint16_t depth,
+                        result_sink& sink )
+{
+    // n = P*R < B, so R <= (B-1)/P
+    mpz_t R_bound;
+    mpz_init( R_bound );
+    mpz_sub_ui( R_bound, bound, 1 );
+    mpz_fdiv_q( R_bound, R_bound, node->P );
+
+    // CN_search needs P > 1, and R and L to fit in a uint64_t
+    bool can_search = ( node->P_len > 0 ) && mpz_fits_ulong_p( R_bound ) && mpz_fits_ulong_p( node->L );
+    // the appended primes past this are eliminated
+    uint64_t q_max = can_search ? rule.append_limit( mpz_get_uint128( node->P ), mpz_get_ui( node->L ), mpz_get_ui( R_bound ) ) : UINT64_MAX;
+
+    // the children are the primes from start up to where the loop of search would break
+    uint64_t stop = start;
+    if( depth < APPEND_LIMIT && node->P_len < MAX_PRIME_FACTORS )
+    {
+        const primes_stuff* q_stuff;
+        for( ; ( q_stuff = admissible.at( stop ) ) != nullptr; stop++ )
+        {
+            uint64_t q = q_stuff->prime;
+            if( q > q_max || mpz_cmp_ui( R_bound, q ) < 0 || is_empty( *node, R_bound, q ) ) { break; }
+        }
+    }
+
+    // every prime below admissible[stop] is appended by a child, or is inadmissible and cannot divide R
+    const primes_stuff* stop_stuff = admissible.at( stop );
+    node->append_bound = ( stop_stuff != nullptr ) ? stop_stuff->prime - 1 : std::max( list_bound, node->append_bound );
+
+    if( stop > start )
+    {
+        std::shared_ptr< const Preproduct > parent = node;
+        admissible.claim( start );
+        pool->push( [this, parent, &admissible, list_bound, start, stop, depth, &sink]()
+        {
+            walk_children( parent, admissible, list_bound, start, stop, depth + 1, sink );
+        } );
+    }
+
+    if( !is_empty( *node, R_bound, node->append_bound + 1 ) )
+    {
+        if( can_search ) { node->CN_search( mpz_get_ui( R_bound ), sink ); }
+        else
+        {
+            gmp_fprintf( stderr, "preproduct P = %Zd with L = %Zd and append bound %lu cannot be searched\n", node->P, node->L, node->append_bound );
+        }
+    }
+
+    mpz_clear( R_bound );
+}
+
+void Tabulation::walk_children( std::shared_ptr< const Preproduct > parent, admissible_primes& admissible, uint64_t list_bound,
+                                uint64_t begin, uint64_t end, uint16_t depth, result_sink& sink )
+{
+    while( end - begin > TREE_TASK_CHILDREN )
+    {
+        uint64_t middle = begin + ( end - begin ) / 2;
+        admissible.claim( middle );
+        pool->push( [this, parent, &admissible, list_bound, middle, end, depth, &sink]()
+        {
+            walk_children( parent, admissible, list_bound, middle, end, depth, sink );
+        } );
+        end = middle;
+    }
+
+    // the cursor starts where the parent's is, and only moves forward over this range
+    admissibility_cursor cursor = parent->cursor;
+    for( uint64_t i = begin; i < end; i++ )
+    {
+        const primes_stuff* q_stuff = admissible.at( i );
+        if( cursor.len_appended_primes > 0 && !cursor.is_admissible( q_stuff->prime ) ) { continue; }
+        std::shared_ptr< Preproduct > child = std::make_shared< Preproduct >();
+        if( !child->appending( *parent, cursor, *q_stuff ) )
+        {
+            gmp_fprintf( stderr, "preproduct P = %Zd times %u has more than %d primes in L\n", parent->P, q_stuff->prime, L_MAX_PRIMES );
+            continue;
+        }
+        visit( child, admissible, list_bound, i + 1, depth, sink );
+    }
+    // claimed by whoever queued this task
+    admissible.unclaim( begin );
+}
+
+bool Tabulation::is_empty( const Preproduct& node, mpz_t& R_bound, uint64_t q )
+{
+    if( node.P_len >= 3 ) { return false; }
+
+    // R has at least 3 - P_len primes, each at least q
+    mpz_t smallest_R;
+    mpz_init( smallest_R );
+    mpz_ui_pow_ui( smallest_R, q, 3 - node.P_len );
+    bool return_val = ( mpz_cmp( smallest_R, R_bound ) > 0 );
+    mpz_clear( smallest_R );
+    return return_val;
+}
@@ -0,0 +1,109 @@
+#ifndef TABULATION_H
+#define TABULATION_H
+
+#include "Preproduct.h"
+#include "Precomputation.h"
+#include <gmp.h>
+#include <cstdint>
+#include "results.h"
+#include "work_stealing.h"
+#include <vector>
+#include <array>
+#include <memory>
+
+// a ready-to-scan arithmetic progression R = r_star + k*L with R <= R_bound
+// for the job {P, L, b} with r_star = P^{-1} mod L
+struct progression
+{
+    uint64_t job_id;
+    uint64_t P;
+    uint64_t L;
+    uint64_t b;
+    uint64_t r_star;
+    uint64_t R_bound;
+    job_primes primes;      // from the precomputation, so the job is factored without divisions
+};
+
+// finishes the jobs of the precomputation:  all CN n = P*R < B for a job {P, L, b}
+// where the primes dividing R exceed b
+// a job is continued prime-by-prime with the primes past b admissible to P
+// under the same elimination rule as the precomputation, up to APPEND_LIMIT appends,
+// and CN_search finishes each preproduct once the rule eliminates it
+// a preproduct with a long progression goes on past the rule, see Precomputation::append_limit
+// each CN found goes to output with its prime factors and the id of its job
+class Tabulation{
+
+public:
+
+    // B = 10^bound_exponent, the elimination rule is P*L*C*p^n > B
+    Tabulation( uint64_t bound_exponent, uint64_t p_exponent, uint64_t C_constant, result_sink& init_output );
+    ~Tabulation();
+    Tabulation( const Tabulation& ) = delete;
+    Tabulation& operator=( const Tabulation& ) = delete;
+
+    // threads for the Fermat tests of each long CN_search, see Preproduct::CN_search_staged
+    uint16_t fermat_workers = 0;
+
+    // threads besides the calling one for the appending tree of each job, 0 to walk it on the calling thread
+    // the nodes of the tree are tasks of a work_stealing_pool, so one big job is spread over all of them
+    // the job telemetry of run_job then only has the calling thread's share
+    uint16_t tree_workers = 0;
+
+    // a job of the precomputation tree, so the primes of P are precomputation primes up to b
+    // primes is the job's entry of Precomputation::working_primes or output_primes
+    void run_job( unsigned __int128 P, unsigned __int128 L, uint64_t b, const job_primes& primes, uint64_t job_id );
+
+    // the output jobs of the precomputation tree
+    // the rule eliminated them at the next precomputation prime, so nothing is appended
+    // and each one is a single CN_search on a progression from make_progressions
+    // jobs[i] has the id first_job_id + i, and primes[i] are its primes from Precomputation::output_primes
+    void run_output_jobs( const std::vector< precomputation_job >& jobs, const std::vector< job_primes >& primes, uint64_t first_job_id );
+
+    // the progressions of the jobs, set up in groups with the same L
+    // so that each group takes one extended gcd, see batch_inverse
+    // the indices of the jobs that cannot be scanned as a progression ( P = 1, B/P >= 2^64, or P or L past 64 bits )
+    // go to unscannable
+    std::vector< progression > make_progressions( const std::vector< precomputation_job >& jobs, const std::vector< job_primes >& primes,
+                                                  uint64_t first_job_id, std::vector< size_t >& unscannable );
+
+    void run_progression( const progression& job );
+
+    // scans many progressions with only a few candidates each as one stream
+    // the candidates of all of them are tagged by their job and Fermat tested a batch at a time,
+    // so a job costs no set-up of its own unless one of its candidates is a pseudoprime
+    void scan_progressions( const std::vector< progression >& jobs );
+
+private:
+
+    mpz_t bound;
+    Precomputation rule;
+    result_sink& output;
+
+    // appends the primes of admissible from index start on to node, while the rule allows,
+    // then searches node for the R whose primes exceed the last prime considered
+    // admissible makes the primes admissible to the job's P up to list_bound
+    void search( Preproduct& node, admissible_primes& admissible, uint64_t list_bound, uint64_t start, uint16_t depth );
+
+    // the same walk as search with tree_workers, as tasks of pool
+    // visit finds how far the children of node go, the same place the loop of search stops,
+    // queues them as one range, and searches node;  node is only read once its children are queued
+    // walk_children splits a range of the children of parent in halves for other threads to steal,
+    // then appends each admissible prime of what is left to parent with its own admissibility_cursor,
+    // so the tasks of one parent share it and none of them changes it
+    // each walk_children task holds a claim on admissible from its first child on, see admissible_primes::claim,
+    // so the primes below every task are dropped as the walk goes;  sink has to be safe to use from every thread
+    void visit( std::shared_ptr< Preproduct > node, admissible_primes& admissible, uint64_t list_bound, uint64_t start, uint16_t depth,
+                result_sink& sink );
+    void walk_children( std::shared_ptr< const Preproduct > parent, admissible_primes& admissible, uint64_t list_bound,
+                        uint64_t begin, uint64_t end, uint16_t depth, result_sink& sink );
+    std::unique_ptr< work_stealing_pool > pool;
+
+    // true if P*R < B has no CN for R with all of its primes at least q
+    // a CN has at least 3 prime factors, so this only happens when P has fewer than 3
+    bool is_empty( const Preproduct& node, mpz_t& R_bound, uint64_t q );
+
+    // the candidate R of the job is a base 2 pseudoprime:  its job is set up and searched at R alone
+    void finish_candidate( const progression& job, uint64_t R );
+};
+
+#endif
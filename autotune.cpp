@@ -0,0 +1,466 @@
+// autotuner for the elimination rule P*L*C*p^n > B used by precomputation.cpp
+// and for the number of primes appended prime-by-prime after it (APPEND_LIMIT)
+//
+// the cost model:
+// an output job (P, L, b) is handed to CN_search, which picks one of three searches, see Preproduct::CN_search_engine
+//   final_prime_search, charged for each divisor of P-1
+//   factor_sieve_search, charged for each of the about B/(P*L) terms R of the progression
+//   the Fermat walk:  only R free of primes up to b can give a CN from the job,
+//   CN_search sieves out the rest, so it is charged a Fermat test for that fraction of the terms
+// a working job (one that the primes of the precomputation did not eliminate)
+// is continued prime-by-prime past the last precomputation prime:
+//   for each admissible prime q > b, in increasing order
+//     if q is past the append limit, then CN_search on (P, L) with primes below q excluded and stop
+//     otherwise append q and continue the same way with P*q
+//   once append_depth primes have been appended, CN_search is forced
+// the append limit is the rule's largest uneliminated prime, or sqrt( B/P ) for a long progression,
+// see Precomputation::append_limit, so an output job with a long progression is continued the same way
+//
+// the time of a unit of each search is measured by running CN_search on sampled output jobs
+// the time of an append is measured by running appending on sampled working jobs
+// both are pooled over all of the rules tried
+// subtrees below the working jobs and the continued output jobs are estimated with Knuth's random path estimator
+// both are sampled in proportion to B/(P*L) since a few small preproducts carry most of the cost
+// the rule and depth with the least estimated total time is recommended
+
+#include "Preproduct.h"
+#include "Precomputation.h"
+#include "results.h"
+#include "telemetry.h"
+#include <gmp.h>
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include <vector>
+#include <array>
+
+// the candidate rules:  n in [ TUNE_MIN_EXPONENT, TUNE_MAX_EXPONENT ] and C from the list below
+#define TUNE_MIN_EXPONENT 3
+#define TUNE_MAX_EXPONENT 6
+#define TUNE_C_COUNT 8
+const uint64_t tune_C_constants[ TUNE_C_COUNT ] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+
+// a rule whose tree holds more jobs than this is skipped
+// 30 million jobs is about 720 MB
+#define TUNE_JOB_LIMIT 30'000'000
+// Fermat tests done per sampled CN_search call
+#define TUNE_SCAN_CANDIDATES 2'000
+// appending calls timed per sampled working job
+#define TUNE_APPENDS 64
+// primes are sieved up to at most this bound
+// a continuation that runs past the sieve is charged as a CN_search at that point
+#define TUNE_SIEVE_BOUND 100'000'000
+// fixed seed so that two runs on the same machine sample the same jobs
+#define TUNE_SEED 2024
+
+using std::chrono::high_resolution_clock;
+using std::chrono::duration;
+
+// the measured quantities and the target that the estimates need
+struct tune_state
+{
+    uint64_t bound_exponent;
+    long double bound;               // B = 10^bound_exponent
+    double seconds_per_work[ SEARCH_ENGINE_COUNT ];   // a divisor, a term, or a Fermat test, see search_work
+    double seconds_per_append;       // one call to Preproduct::appending
+    std::vector< uint32_t > primes;  // odd primes up to the sieve bound
+    std::mt19937_64 rng;
+    // per-job counters of the sampled CN_search calls, when built with CN_TELEMETRY
+    std::ofstream telemetry_log;
+    uint64_t job_id;
+
+    // pooled measurements
+    double search_time[ SEARCH_ENGINE_COUNT ];
+    double search_count[ SEARCH_ENGINE_COUNT ];
+    double append_time;
+    double append_count;
+};
+
+// what is kept of a rule's tree after it is measured
+struct rule_summary
+{
+    uint64_t p_exponent;
+    uint64_t C_constant;
+    uint64_t output_count;
+    uint64_t working_count;
+    long double output_work[ SEARCH_ENGINE_COUNT ];   // over the output jobs searched as they are, see search_work
+    // working jobs drawn with probability B/(P*L) / working_weight
+    std::vector< precomputation_job > working_sample;
+    long double working_weight;
+    // the output jobs with a long progression, continued past the rule like a working job, drawn the same way
+    std::vector< precomputation_job > continued_sample;
+    long double continued_weight;
+};
+
+// fraction of integers free of odd primes up to b, by Mertens' theorem
+// prod_{ 2 < p <= b } ( 1 - 1/p ) ~ 2 e^{-gamma} / log( b )
+long double rough_density( uint64_t b )
+{
+    if( b < 3 ) { return 1; }
+    return std::min( 1.0L, 1.1229189671337703L / logl( b ) );
+}
+
+// number of primes dividing a preproduct from the precomputation
+uint64_t omega( Precomputation& tree, const precomputation_job& job )
+{
+    uint64_t P_primes[ 128 ], L_primes[ 128 ];
+    uint16_t L_exponents[ 128 ];
+    uint16_t P_len, L_len;
+    tree.job_factors( job, P_primes, P_len, L_primes, L_exponents, L_len );
+    return P_len;
+}
+
+// index of the first prime of state.primes past b
+uint64_t first_past( tune_state& state, uint64_t b )
+{
+    return std::upper_bound( state.primes.begin(), state.primes.end(), b ) - state.primes.begin();
+}
+
+// the largest prime appended to P, see Precomputation::append_limit
+// which needs L and B/P below 2^64, past that only the rule applies
+uint64_t append_bound( tune_state& state, Precomputation& tree, unsigned __int128 P, unsigned __int128 L )
+{
+    long double R_bound = state.bound / P;
+    if( ( L >> 64 ) != 0 || R_bound >= 0x1p64L ) { return tree.largest_uneliminated( P, L ); }
+    return tree.append_limit( P, L, (uint64_t) R_bound );
+}
+
+// the work of the search CN_search hands ( P, L ) to when primes up to b are excluded from R, for R <= R_bound
+// the number of divisors of P-1 for final_prime_search, of terms for factor_sieve_search,
+// and of Fermat tests for the walk, which sieves out the terms with a prime up to b
+// P and L past 64 bits are charged as a walk
+long double search_work( unsigned __int128 P, unsigned __int128 L, uint64_t b, long double R_bound, search_engine& engine )
+{
+    engine = ENGINE_FERMAT_WALK;
+    if( P < 2 || ( P >> 64 ) != 0 || ( L >> 64 ) != 0 || R_bound >= 1.8e19L ) { return rough_density( b ) * ( R_bound / L ); }
+
+    uint64_t P64 = P, L64 = L, r_star, work;
+    uint64_t residue = P64 % L64;
+    batch_inverse( &residue, &r_star, 1, L64 );
+    engine = Preproduct::CN_search_engine( P64, L64, b, (uint64_t) R_bound, r_star, work );
+    return ( engine == ENGINE_FERMAT_WALK ) ? rough_density( b ) * work : work;
+}
+
+// the estimated time of CN_search on ( P, L ) with primes up to b excluded from R
+// P has P_len primes, and a CN has at least 3
+// so R needs at least 3 - P_len primes, each larger than b
+// when that cannot fit below B/P there is nothing to search
+long double search_time( tune_state& state, unsigned __int128 P, unsigned __int128 L, uint64_t P_len, uint64_t b )
+{
+    long double R_bound = state.bound / P;
+    if( P_len < 3 && powl( b, 3 - P_len ) >= R_bound ) { return 0; }
+    search_engine engine;
+    long double work = search_work( P, L, b, R_bound, engine );
+    return state.seconds_per_work[ engine ] * work;
+}
+
+// times CN_search on up to sample_count output jobs, each capped at TUNE_SCAN_CANDIDATES terms
+// and pools the time by the search CN_search picked
+void measure_search( tune_state& state, std::vector< precomputation_job >& jobs, uint64_t sample_count )
+{
+    std::vector< precomputation_job > sample;
+    std::sample( jobs.begin(), jobs.end(), std::back_inserter( sample ), sample_count, state.rng );
+
+    // the CN themselves are not needed
+    std::ostream null_output( nullptr );
+    text_results found( null_output );
+
+    for( auto& job : sample )
+    {
+        // CN_search needs L even and R < 2^64, and initializing P and L below 2^64
+        if( job[0] == 1 || ( job[0] >> 64 ) != 0 || ( job[1] >> 64 ) != 0 ) { continue; }
+        long double R_bound = state.bound / job[0];
+        long double cap = (long double) TUNE_SCAN_CANDIDATES * job[1];
+        uint64_t bound_on_R = (uint64_t) std::min( R_bound, cap );
+        if( bound_on_R < job[1] ) { continue; }
+
+        search_engine engine;
+        long double work = search_work( job[0], job[1], job[2], bound_on_R, engine );
+
+        telemetry_job_begin();
+        Preproduct PP;
+        PP.initializing( job[0], job[1], job[2] );
+
+        auto t1 = high_resolution_clock::now();
+        PP.CN_search( bound_on_R, found );
+        auto t2 = high_resolution_clock::now();
+        telemetry_job_end( state.telemetry_log, state.job_id++, job[0], job[1], job[2] );
+
+        duration<double> seconds = t2 - t1;
+        state.search_time[ engine ] += seconds.count();
+        state.search_count[ engine ] += work;
+    }
+}
+
+// times appending of the first admissible primes past b on up to sample_count working jobs
+void measure_append( tune_state& state, std::vector< precomputation_job >& jobs, uint64_t sample_count )
+{
+    std::vector< precomputation_job > sample;
+    std::sample( jobs.begin(), jobs.end(), std::back_inserter( sample ), sample_count, state.rng );
+
+    std::vector< primes_stuff > to_append;
+    for( auto& job : sample )
+    {
+        // initializing needs P and L below 2^64
+        if( ( job[0] >> 64 ) != 0 || ( job[1] >> 64 ) != 0 ) { continue; }
+        to_append.clear();
+        for( uint64_t i = first_past( state, job[2] ); i < state.primes.size() && to_append.size() < TUNE_APPENDS; i++ )
+        {
+            uint64_t q = state.primes[i];
+            if( std::gcd( (uint64_t) ( job[0] % ( q - 1 ) ), q - 1 ) == 1 )
+            {
+                to_append.push_back( make_primes_stuff( state.primes[i] ) );
+            }
+        }
+
+        Preproduct PP;
+        Preproduct child;
+        PP.initializing( job[0], job[1], job[2] );
+
+        auto t1 = high_resolution_clock::now();
+        for( auto& p : to_append ) { child.appending( PP, p ); }
+        auto t2 = high_resolution_clock::now();
+
+        duration<double> seconds = t2 - t1;
+        state.append_time += seconds.count();
+        state.append_count += to_append.size();
+    }
+}
+
+// one random path down the continuation of the job ( P, L, b )
+// Knuth's estimator:  each node's cost is weighted by the inverse of the probability of the path to it
+// the average over many paths is an unbiased estimate of the cost of the whole subtree
+// a child P*q is picked in proportion to B/(P*q*L'), like the jobs, since the few with a long progression carry most of the cost
+long double random_path( tune_state& state, Precomputation& tree, precomputation_job& job, uint64_t append_depth )
+{
+    unsigned __int128 P = job[0];
+    unsigned __int128 L = job[1];
+    uint64_t b = job[2];
+    uint64_t P_len = omega( tree, job );
+    uint64_t start = first_past( state, b );
+    uint64_t depth = 0;
+    long double weight = 1;
+    long double cost = 0;
+
+    std::vector< uint64_t > children;
+    std::vector< double > child_weights;
+    while( true )
+    {
+        children.clear();
+        child_weights.clear();
+        // primes below stop_prime are decided once the children are enumerated
+        uint64_t stop_prime = b;
+        if( depth < append_depth )
+        {
+            uint64_t q_max = append_bound( state, tree, P, L );
+            uint64_t i = start;
+            for( ; i < state.primes.size(); i++ )
+            {
+                uint64_t q = state.primes[i];
+                if( q > q_max ) { break; }
+                // admissible if gcd( P, q-1 ) = 1
+                if( std::gcd( (uint64_t) ( P % ( q - 1 ) ), q - 1 ) == 1 )
+                {
+                    // B/(P*L) is the same for every child, only q*L'/L differs
+                    uint64_t L_growth = ( q - 1 ) / std::gcd( (uint64_t) ( L % ( q - 1 ) ), q - 1 );
+                    children.push_back( i );
+                    child_weights.push_back( 1.0 / ( (double) q * L_growth ) );
+                }
+            }
+            stop_prime = ( i < state.primes.size() ) ? state.primes[i] - 1 : state.primes.back();
+        }
+
+        long double node_cost = search_time( state, P, L, P_len, stop_prime );
+        cost += weight * ( node_cost + children.size() * state.seconds_per_append );
+        if( children.empty() ) { break; }
+
+        std::discrete_distribution< uint64_t > pick( child_weights.begin(), child_weights.end() );
+        uint64_t c = pick( state.rng );
+        weight *= std::accumulate( child_weights.begin(), child_weights.end(), 0.0L ) / child_weights[c];
+        uint64_t i = children[c];
+        uint64_t q = state.primes[i];
+        L = L * ( ( q - 1 ) / std::gcd( (uint64_t) ( L % ( q - 1 ) ), q - 1 ) );
+        P = P * q;
+        P_len++;
+        b = q;
+        start = i + 1;
+        depth++;
+    }
+    return cost;
+}
+
+// importance sample of jobs, with replacement, in proportion to B/(P*L)
+void sample_jobs( tune_state& state, std::vector< precomputation_job >& jobs, uint64_t sample_count,
+                  std::vector< precomputation_job >& sample, long double& weight )
+{
+    weight = 0;
+    if( jobs.empty() ) { return; }
+    std::vector< double > weights;
+    weights.reserve( jobs.size() );
+    for( auto& job : jobs )
+    {
+        weights.push_back( (double) ( state.bound / ( (long double) job[0] * job[1] ) ) );
+        weight += weights.back();
+    }
+    std::discrete_distribution< uint64_t > pick( weights.begin(), weights.end() );
+    for( uint64_t i = 0; i < sample_count; i++ )
+    {
+        sample.push_back( jobs[ pick( state.rng ) ] );
+    }
+}
+
+// estimated total time of the jobs a sample was drawn from, with append_depth
+long double estimate_sample( tune_state& state, Precomputation& tree, std::vector< precomputation_job >& sample,
+                             long double weight, uint64_t append_depth )
+{
+    if( sample.empty() ) { return 0; }
+    long double total = 0;
+    for( auto& job : sample )
+    {
+        // one random path per draw, the draws are already weighted
+        long double job_weight = state.bound / ( (long double) job[0] * job[1] );
+        total += random_path( state, tree, job, append_depth ) / job_weight;
+    }
+    return total / sample.size() * weight;
+}
+
+// estimated total time of the jobs of a rule that are continued past it, with append_depth
+long double estimate_continued( tune_state& state, rule_summary& rule, uint64_t append_depth )
+{
+    // only the rule itself is needed here, the jobs were dropped after measuring
+    Precomputation tree( state.bound_exponent, rule.p_exponent, rule.C_constant );
+    return estimate_sample( state, tree, rule.working_sample, rule.working_weight, append_depth )
+         + estimate_sample( state, tree, rule.continued_sample, rule.continued_weight, append_depth );
+}
+
+int main()
+{
+    tune_state state;
+    state.rng.seed( TUNE_SEED );
+    std::fill( state.search_time, state.search_time + SEARCH_ENGINE_COUNT, 0 );
+    std::fill( state.search_count, state.search_count + SEARCH_ENGINE_COUNT, 0 );
+    state.append_time = 0;
+    state.append_count = 0;
+    state.job_id = 0;
+    if( TELEMETRY_ENABLED ) { state.telemetry_log.open( "autotune_telemetry.jsonl" ); }
+
+    std::cout << "What is the bound B = 10^k?  k = " ;
+    std::cin >> state.bound_exponent;
+    std::cout << "How many primes to use? " ;
+    uint64_t prime_count;
+    std::cin >> prime_count;
+    std::cout << "How many jobs to sample per rule? " ;
+    uint64_t sample_count;
+    std::cin >> sample_count;
+    std::cout << std::endl;
+
+    state.bound = powl( 10.0L, state.bound_exponent );
+
+    // the rule needs primes up to ( B/C )^( 1/n ) for the smallest n tried,
+    // and a long progression up to sqrt( B/P ), so sqrt( B ) covers both
+    uint64_t prime_bound = (uint64_t) sqrtl( state.bound ) + 1;
+    prime_bound = std::min( prime_bound, (uint64_t) TUNE_SIEVE_BOUND );
+    state.primes = sieve_primes( 2, prime_bound );
+
+    // first pass:  build each tree, measure on its jobs, and keep a summary
+    std::vector< rule_summary > rules;
+    for( uint64_t n = TUNE_MIN_EXPONENT; n <= TUNE_MAX_EXPONENT; n++ )
+    {
+        for( int c = 0; c < TUNE_C_COUNT; c++ )
+        {
+            uint64_t C = tune_C_constants[ c ];
+            Precomputation tree( state.bound_exponent, n, C );
+            if( !tree.build( prime_count, false, TUNE_JOB_LIMIT ) )
+            {
+                std::cout << "n = " << n << " and C = " << C << " skipped: more than " << TUNE_JOB_LIMIT << " jobs" << std::endl;
+                continue;
+            }
+
+            measure_search( state, tree.output_jobs, sample_count );
+            measure_append( state, tree.working_jobs, sample_count );
+
+            rule_summary rule;
+            rule.p_exponent = n;
+            rule.C_constant = C;
+            rule.output_count = tree.output_jobs.size();
+            rule.working_count = tree.working_jobs.size();
+            std::fill( rule.output_work, rule.output_work + SEARCH_ENGINE_COUNT, 0 );
+            std::vector< precomputation_job > continued;
+            for( auto& job : tree.output_jobs )
+            {
+                if( append_bound( state, tree, job[0], job[1] ) > job[2] ) { continued.push_back( job ); continue; }
+                // as in search_time, with the work kept by search until the times are known
+                long double R_bound = state.bound / job[0];
+                uint64_t P_len = omega( tree, job );
+                if( P_len < 3 && powl( job[2], 3 - P_len ) >= R_bound ) { continue; }
+                search_engine engine;
+                long double work = search_work( job[0], job[1], job[2], R_bound, engine );
+                rule.output_work[ engine ] += work;
+            }
+            sample_jobs( state, tree.working_jobs, sample_count, rule.working_sample, rule.working_weight );
+            sample_jobs( state, continued, sample_count, rule.continued_sample, rule.continued_weight );
+            rules.push_back( rule );
+        }
+    }
+
+    // a search none of the samples went to is charged like the walk, or like one that was measured
+    int fallback = -1;
+    for( int e = 0; e < SEARCH_ENGINE_COUNT; e++ )
+    {
+        if( state.search_count[e] > 0 && ( fallback < 0 || e == ENGINE_FERMAT_WALK ) ) { fallback = e; }
+    }
+    if( rules.empty() || fallback < 0 )
+    {
+        std::cout << "No rule could be estimated.  Try fewer primes or a smaller bound." << std::endl;
+        return 1;
+    }
+    for( int e = 0; e < SEARCH_ENGINE_COUNT; e++ )
+    {
+        int measured = ( state.search_count[e] > 0 ) ? e : fallback;
+        state.seconds_per_work[e] = state.search_time[ measured ] / state.search_count[ measured ];
+    }
+    state.seconds_per_append = ( state.append_count == 0 ) ? 0 : state.append_time / state.append_count;
+
+    std::cout << "Measured " << state.seconds_per_work[ ENGINE_FINAL_PRIME ] << " s per divisor of final_prime_search, "
+              << state.seconds_per_work[ ENGINE_FACTOR_SIEVE ] << " s per term of factor_sieve_search, "
+              << state.seconds_per_work[ ENGINE_FERMAT_WALK ] << " s per Fermat test and " << state.seconds_per_append << " s per append" << std::endl;
+    std::cout << std::endl;
+
+    // second pass:  estimates with the pooled measurements
+    uint64_t best_exponent = 0, best_C = 0, best_depth = 0;
+    long double best_time = -1;
+
+    std::cout << "n C output_jobs working_jobs estimated_seconds_by_append_depth" << std::endl;
+    for( auto& rule : rules )
+    {
+        std::cout << rule.p_exponent << " " << rule.C_constant << " " << rule.output_count << " " << rule.working_count;
+        long double output_time = 0;
+        for( int e = 0; e < SEARCH_ENGINE_COUNT; e++ ) { output_time += state.seconds_per_work[e] * rule.output_work[e]; }
+        for( uint64_t depth = 0; depth <= APPEND_LIMIT; depth++ )
+        {
+            long double total_time = output_time + estimate_continued( state, rule, depth );
+            std::cout << " " << (double) total_time;
+            if( best_time < 0 || total_time < best_time )
+            {
+                best_time = total_time;
+                best_exponent = rule.p_exponent;
+                best_C = rule.C_constant;
+                best_depth = depth;
+            }
+        }
+        std::cout << std::endl;
+    }
+
+    std::cout << std::endl;
+    std::cout << "Recommended elimination rule:  n = " << best_exponent << " and C = " << best_C << std::endl;
+    std::cout << "Recommended append depth (APPEND_LIMIT):  " << best_depth << std::endl;
+    std::cout << "Estimated total time:  " << (double) best_time << " s = " << (double) ( best_time / 3600 ) << " hours" << std::endl;
+
+    telemetry_merge();
+    telemetry_write_totals( state.telemetry_log );
+    return 0;
+}
@@ -0,0 +1,301 @@
+// reproducible microbenchmarks for the hot kernels
+// every kernel runs on fixed inputs:  fixed seeds for random numbers
+// and the preproduct P = 515410417841 = 11*17*29*31*37*41*43*47 with L = 115920
+// that CN_search.cpp was timed on
+//
+// results are written as JSON so that runs on two commits can be compared
+// each kernel is run BENCH_REPETITIONS times and the min and median are reported
+// the checksum of a kernel only depends on its inputs, so it should not change between commits
+// unless the kernel's results changed
+//
+// usage:  ./benchmark [ output file, default benchmark.json ]
+
+#include "Preproduct.h"
+#include "Precomputation.h"
+#include "results.h"
+#include "montgomery.h"
+#include "cpu_dispatch.h"
+#include <gmp.h>
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <array>
+
+#define BENCH_REPETITIONS 5
+#define BENCH_SEED 2024
+
+// the preproduct from CN_search.cpp
+#define BENCH_P 515410417841
+#define BENCH_L 115920
+#define BENCH_b 47
+
+// sizes of each kernel's workload
+#define BENCH_FERMAT_COUNT 20'000
+#define BENCH_FERMAT_BITS 80
+#define BENCH_ADMISSIBLE_BOUND 10'000'000
+#define BENCH_APPEND_COUNT 2'000
+#define BENCH_INITIALIZING_COUNT 20'000
+#define BENCH_SCAN_CANDIDATES 100'000
+#define BENCH_TREE_BOUND_EXPONENT 18
+#define BENCH_TREE_EXPONENT 5
+
+using std::chrono::high_resolution_clock;
+using std::chrono::duration;
+
+struct bench_result
+{
+    std::string name;
+    std::string params;        // a JSON object
+    uint64_t operations;       // per repetition
+    std::vector< double > seconds;
+    uint64_t checksum;
+};
+
+// counts the CN that a search finds, and sums them mod 1'000'000'007
+// so that the CN_search checksum changes if a different set of CN is found
+class counting_results : public result_sink
+{
+public:
+    uint64_t count = 0;
+    uint64_t residue_sum = 0;
+
+    void found( const mpz_t n, const uint64_t* /* primes */, uint16_t /* count */ )
+    {
+        count++;
+        residue_sum += mpz_fdiv_ui( n, 1'000'000'007 );
+    }
+};
+
+// runs kernel BENCH_REPETITIONS times, the kernel returns its checksum
+template< typename Kernel >
+bench_result run_bench( std::string name, std::string params, uint64_t operations, Kernel kernel )
+{
+    bench_result result;
+    result.name = name;
+    result.params = params;
+    result.operations = operations;
+    result.checksum = 0;
+    for( int rep = 0; rep < BENCH_REPETITIONS; rep++ )
+    {
+        auto t1 = high_resolution_clock::now();
+        result.checksum = kernel();
+        auto t2 = high_resolution_clock::now();
+        duration<double> seconds = t2 - t1;
+        result.seconds.push_back( seconds.count() );
+    }
+    std::sort( result.seconds.begin(), result.seconds.end() );
+    return result;
+}
+
+void write_json( std::ostream& out, std::vector< bench_result >& results )
+{
+    out << "{" << std::endl;
+    out << "  \"seed\": " << BENCH_SEED << "," << std::endl;
+    out << "  \"repetitions\": " << BENCH_REPETITIONS << "," << std::endl;
+    // the version of the CPU_DISPATCH kernels the numbers are for
+    out << "  \"cpu_dispatch\": \"" << cpu_dispatch_level() << "\"," << std::endl;
+    out << "  \"results\": [" << std::endl;
+    for( size_t i = 0; i < results.size(); i++ )
+    {
+        bench_result& r = results[i];
+        double min_seconds = r.seconds.front();
+        double median_seconds = r.seconds[ r.seconds.size() / 2 ];
+        out << "    { \"name\": \"" << r.name << "\"";
+        out << ", \"params\": " << r.params;
+        out << ", \"operations\": " << r.operations;
+        out << ", \"min_seconds\": " << min_seconds;
+        out << ", \"median_seconds\": " << median_seconds;
+        out << ", \"ns_per_op_min\": " << 1e9 * min_seconds / r.operations;
+        out << ", \"ns_per_op_median\": " << 1e9 * median_seconds / r.operations;
+        out << ", \"checksum\": " << r.checksum << " }";
+        out << ( ( i + 1 < results.size() ) ? "," : "" ) << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+int main( int argc, char* argv[] )
+{
+    std::vector< bench_result > results;
+    std::string output_name = ( argc > 1 ) ? argv[1] : "benchmark.json";
+
+    Preproduct PP;
+    PP.initializing( BENCH_P, BENCH_L, BENCH_b );
+
+    // fermat_test on random odd n of about the size of B = 10^24, base 2
+    {
+        gmp_randstate_t rand_state;
+        gmp_randinit_default( rand_state );
+        gmp_randseed_ui( rand_state, BENCH_SEED );
+
+        mpz_t* inputs = new mpz_t[ BENCH_FERMAT_COUNT ];
+        for( int i = 0; i < BENCH_FERMAT_COUNT; i++ )
+        {
+            mpz_ptr n = inputs[i];
+            mpz_init( n );
+            mpz_urandomb( n, rand_state, BENCH_FERMAT_BITS );
+            mpz_setbit( n, BENCH_FERMAT_BITS - 1 );
+            mpz_setbit( n, 0 );
+        }
+        mpz_t base;
+        mpz_init_set_ui( base, 2 );
+        mpz_t strong_result;
+        mpz_init( strong_result );
+
+        results.push_back( run_bench( "fermat_test", "{ \"bits\": 80, \"base\": 2 }", BENCH_FERMAT_COUNT, [&]()
+        {
+            uint64_t checksum = 0;
+            for( int i = 0; i < BENCH_FERMAT_COUNT; i++ )
+            {
+                checksum += PP.fermat_test( inputs[i], base, strong_result );
+            }
+            return checksum;
+        } ) );
+
+        // the same n through the Montgomery kernels, base 2 and the sliding window of base 3
+        std::vector< uint128_t > inputs128( BENCH_FERMAT_COUNT );
+        for( int i = 0; i < BENCH_FERMAT_COUNT; i++ )
+        {
+            uint64_t limbs[2] = { 0, 0 };
+            mpz_export( limbs, 0, -1, sizeof( uint64_t ), 0, 0, inputs[i] );
+            inputs128[i] = ( (uint128_t) limbs[1] << 64 ) | limbs[0];
+        }
+        for( uint64_t b : { 2, 3 } )
+        {
+            results.push_back( run_bench( "fermat_montgomery", "{ \"bits\": 80, \"base\": " + std::to_string( b ) + " }", BENCH_FERMAT_COUNT, [&]()
+            {
+                montgomery mont;
+                uint128_t strong128;
+                uint64_t checksum = 0;
+                for( int i = 0; i < BENCH_FERMAT_COUNT; i++ )
+                {
+                    mont.set_modulus( inputs128[i] );
+                    checksum += mont.fermat_test( b, __builtin_ctzll( (uint64_t) inputs128[i] - 1 ), strong128 );
+                }
+                return checksum;
+            } ) );
+        }
+
+        for( int i = 0; i < BENCH_FERMAT_COUNT; i++ ) { mpz_clear( inputs[i] ); }
+        delete[] inputs;
+        mpz_clear( base );
+        mpz_clear( strong_result );
+        gmp_randclear( rand_state );
+    }
+
+    // the primes past b admissible to P, used by the appending kernels
+    std::vector< uint32_t > primes = sieve_primes( BENCH_b, BENCH_ADMISSIBLE_BOUND );
+    std::vector< primes_stuff > admissible;
+    for( auto p : primes )
+    {
+        bool admissible_to_P = true;
+        for( int i = 0; i < PP.P_len; i++ )
+        {
+            admissible_to_P = admissible_to_P && ( p % PP.P_primes[i] != 1 );
+        }
+        if( admissible_to_P ) { admissible.push_back( make_primes_stuff( p ) ); }
+    }
+
+    // is_admissible on every prime up to BENCH_ADMISSIBLE_BOUND, in increasing order
+    // for a child of P with the first admissible prime appended
+    {
+        Preproduct child;
+        uint64_t operations = 0;
+        for( auto p : primes ) { operations += ( p > admissible[0].prime ); }
+
+        results.push_back( run_bench( "is_admissible", "{ \"P\": 515410417841, \"appended\": 53, \"prime_bound\": 10000000 }", operations, [&]()
+        {
+            // the cursors in next_inadmissible move forward, so each repetition starts from a fresh append
+            child.appending( PP, admissible[0] );
+            uint64_t checksum = 0;
+            for( auto p : primes )
+            {
+                if( p > admissible[0].prime ) { checksum += child.is_admissible( p ); }
+            }
+            return checksum;
+        } ) );
+    }
+
+    // appending of the first BENCH_APPEND_COUNT admissible primes to P
+    {
+        Preproduct child;
+        uint64_t count = std::min( (uint64_t) BENCH_APPEND_COUNT, (uint64_t) admissible.size() );
+
+        results.push_back( run_bench( "appending", "{ \"P\": 515410417841, \"L\": 115920 }", count, [&]()
+        {
+            uint64_t checksum = 0;
+            for( uint64_t i = 0; i < count; i++ )
+            {
+                child.appending( PP, admissible[i] );
+                checksum += child.L_len + mpz_fdiv_ui( child.L, 1'000'000'007 );
+            }
+            return checksum;
+        } ) );
+    }
+
+    // initializing on the output jobs of a fixed precomputation tree
+    // and the precomputation tree itself
+    {
+        Precomputation tree( BENCH_TREE_BOUND_EXPONENT, BENCH_TREE_EXPONENT, 1 );
+        uint64_t job_count = 0;
+
+        results.push_back( run_bench( "precomputation_tree", "{ \"bound_exponent\": 18, \"n\": 5, \"C\": 1, \"primes\": 167 }", 1, [&]()
+        {
+            tree.build( PRECOMPUTATION_PRIME_COUNT, false );
+            job_count = tree.output_jobs.size() + tree.working_jobs.size();
+            return job_count;
+        } ) );
+
+        std::vector< precomputation_job > jobs( tree.output_jobs.begin(), tree.output_jobs.begin() + std::min( (size_t) BENCH_INITIALIZING_COUNT, tree.output_jobs.size() ) );
+        Preproduct job_preproduct;
+
+        results.push_back( run_bench( "initializing", "{ \"bound_exponent\": 18, \"n\": 5, \"C\": 1 }", jobs.size(), [&]()
+        {
+            uint64_t checksum = 0;
+            for( auto& job : jobs )
+            {
+                job_preproduct.initializing( job[0], job[1], job[2] );
+                checksum += job_preproduct.P_len + job_preproduct.L_len;
+            }
+            return checksum;
+        } ) );
+
+        // the same jobs with the factors read off the bitsets the precomputation keeps for each job
+        results.push_back( run_bench( "initializing_factored", "{ \"bound_exponent\": 18, \"n\": 5, \"C\": 1 }", jobs.size(), [&]()
+        {
+            uint64_t P_primes[ MAX_PRIME_FACTORS ], L_primes[ L_MAX_PRIMES ];
+            uint16_t L_exponents[ L_MAX_PRIMES ];
+            uint16_t P_len, L_len;
+            uint64_t checksum = 0;
+            for( size_t i = 0; i < jobs.size(); i++ )
+            {
+                const precomputation_job& job = jobs[i];
+                tree.job_factors( job, tree.output_primes[i], P_primes, P_len, L_primes, L_exponents, L_len );
+                job_preproduct.initializing( job[0], job[1], job[2], P_primes, P_len, L_primes, L_exponents, L_len );
+                checksum += job_preproduct.P_len + job_preproduct.L_len;
+            }
+            return checksum;
+        } ) );
+    }
+
+    // the CN_search loop on P for the first BENCH_SCAN_CANDIDATES candidates R
+    // R is small enough here that CN_search hands it to factor_sieve_search,
+    // build with CPPFLAGS=-DFACTOR_SEARCH_MAX_R=0 to time the Fermat walk instead
+    {
+        results.push_back( run_bench( "CN_search", "{ \"P\": 515410417841, \"L\": 115920, \"candidates\": 100000 }", BENCH_SCAN_CANDIDATES, [&]()
+        {
+            counting_results found;
+            PP.CN_search( (uint64_t) BENCH_SCAN_CANDIDATES * BENCH_L, found );
+            return found.count + found.residue_sum;
+        } ) );
+    }
+
+    std::ofstream output_file( output_name );
+    write_json( output_file, results );
+    output_file.close();
+    std::cout << "wrote " << results.size() << " results to " << output_name << std::endl;
+    return 0;
+}
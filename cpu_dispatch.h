@@ -0,0 +1,40 @@
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+// one portable binary for hosts of different CPU generations
+// a function marked CPU_DISPATCH is compiled once for each x86-64 level:
+//   x86-64      the baseline every host has
+//   x86-64-v3   AVX2, BMI2 ( mulx for the 128-bit Montgomery products ) and FMA, Haswell and Zen on
+//   x86-64-v4   AVX-512 F/BW/CD/DQ/VL, Skylake-SP and Zen 4 on
+// and the loader picks the version for the host with cpuid when the program starts ( an ifunc )
+// inline helpers such as the montgomery kernels are compiled into each version at its level
+//
+// a call through the dispatch is an indirect call, so this is for functions that run long,
+// the CN_search loop, the factor sieve, the L merge, and not for the likes of is_admissible
+// make CPPFLAGS=-DNO_MULTIVERSION builds the baseline version alone, e.g. for a profiler
+//
+// the clones are local to the file of the definition, and a call from another file would make a resolver
+// there that cannot reach them, so only functions that are called in their own file are marked:
+// static functions, and private members with CPU_DISPATCH on the declaration as well as the definition
+// the public members, e.g. Preproduct::appending, are plain functions that call them
+
+#if defined( __x86_64__ ) && defined( __GNUC__ ) && !defined( __clang__ ) && !defined( NO_MULTIVERSION )
+#define CPU_DISPATCH __attribute__(( target_clones( "default", "arch=x86-64-v3", "arch=x86-64-v4" ) ))
+#else
+#define CPU_DISPATCH
+#endif
+
+// the level the CPU_DISPATCH functions run at on this host
+inline const char* cpu_dispatch_level()
+{
+#if defined( __x86_64__ ) && defined( __GNUC__ ) && !defined( __clang__ ) && !defined( NO_MULTIVERSION )
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "x86-64-v4" ) ) { return "x86-64-v4"; }
+    if( __builtin_cpu_supports( "x86-64-v3" ) ) { return "x86-64-v3"; }
+    return "x86-64";
+#else
+    return "baseline";
+#endif
+}
+
+#endif
@@ -0,0 +1,45 @@
+#include "huge_pages.h"
+#include <sys/mman.h>
+#include <cstdint>
+#include <cstdlib>
+
+static size_t round_to_huge_pages( size_t bytes )
+{
+    return ( bytes + HUGE_PAGE_BYTES - 1 ) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+}
+
+void* huge_page_allocate( size_t bytes )
+{
+    if( bytes < HUGE_PAGE_MIN_BYTES )
+    {
+        void* memory = malloc( bytes );
+        if( memory == nullptr ) { throw std::bad_alloc(); }
+        return memory;
+    }
+    size_t length = round_to_huge_pages( bytes );
+
+#ifdef MAP_HUGETLB
+    void* memory = mmap( nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    if( memory != MAP_FAILED ) { return memory; }
+#endif
+
+    // THP only backs huge-page aligned ranges, so map an extra huge page and trim both ends to alignment
+    char* mapped = static_cast< char* >( mmap( nullptr, length + HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) );
+    if( mapped == MAP_FAILED ) { throw std::bad_alloc(); }
+    char* aligned = reinterpret_cast< char* >( ( reinterpret_cast< uintptr_t >( mapped ) + HUGE_PAGE_BYTES - 1 ) & ~( HUGE_PAGE_BYTES - 1 ) );
+    if( aligned > mapped ) { munmap( mapped, aligned - mapped ); }
+    munmap( aligned + length, mapped + HUGE_PAGE_BYTES - aligned );
+
+#ifdef MADV_HUGEPAGE
+    // fails harmlessly where THP is not built in
+    madvise( aligned, length, MADV_HUGEPAGE );
+#endif
+    return aligned;
+}
+
+void huge_page_free( void* memory, size_t bytes )
+{
+    if( memory == nullptr ) { return; }
+    if( bytes < HUGE_PAGE_MIN_BYTES ) { free( memory ); }
+    else { munmap( memory, round_to_huge_pages( bytes ) ); }
+}
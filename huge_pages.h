@@ -0,0 +1,44 @@
+#ifndef HUGE_PAGES_H
+#define HUGE_PAGES_H
+
+#include <cstddef>
+#include <new>
+
+// huge-page backed memory for the large tables, e.g. the primes_stuff list of primes_admissible_to_P
+// with up to 5761455 entries, and the SPF table behind factor_small
+// on 4 KiB pages random access into these misses the TLB most of the time, a 2 MiB page covers 512 times as much
+//
+// an allocation of at least HUGE_PAGE_MIN_BYTES is mmap'd on its own, rounded up to whole huge pages:
+//   first from the explicit huge page pool ( MAP_HUGETLB, see /proc/sys/vm/nr_hugepages ),
+//   then as ordinary pages aligned to HUGE_PAGE_BYTES with madvise( MADV_HUGEPAGE ) for transparent huge pages
+// if the pool is empty and THP is off this is an ordinary mmap, and smaller allocations just go to malloc
+// the pages are only faulted in when touched, so a large reserve costs address space and not memory
+
+#define HUGE_PAGE_BYTES ( (size_t) 2 << 20 )
+#define HUGE_PAGE_MIN_BYTES HUGE_PAGE_BYTES
+
+// throws std::bad_alloc if neither mmap nor malloc can give the memory
+void* huge_page_allocate( size_t bytes );
+
+// bytes has to be the size given to huge_page_allocate
+void huge_page_free( void* memory, size_t bytes );
+
+// for std::vector< T, huge_page_allocator< T > >
+template< class T >
+struct huge_page_allocator
+{
+    typedef T value_type;
+
+    huge_page_allocator() = default;
+    template< class U > huge_page_allocator( const huge_page_allocator< U >& ) {}
+
+    T* allocate( size_t count ) { return static_cast< T* >( huge_page_allocate( count * sizeof( T ) ) ); }
+    void deallocate( T* memory, size_t count ) { huge_page_free( memory, count * sizeof( T ) ); }
+};
+
+template< class T, class U >
+bool operator==( const huge_page_allocator< T >&, const huge_page_allocator< U >& ) { return true; }
+template< class T, class U >
+bool operator!=( const huge_page_allocator< T >&, const huge_page_allocator< U >& ) { return false; }
+
+#endif
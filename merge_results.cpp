@@ -0,0 +1,62 @@
+// merges the result shards written by result_writer into one table
+// the CN are sorted by n, one per line:  n followed by its prime factors, the format text_results writes
+// a CN found by two jobs is a bug in the job split, so duplicates are reported and written once
+// a shard that ends in a torn segment, e.g. from a crashed run, contributes its intact segments
+//
+// usage:  ./merge_results table.txt shard [ shard ... ]
+
+#include "results.h"
+#include "Precomputation.h"
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+int main( int argc, char* argv[] )
+{
+    if( argc < 3 )
+    {
+        std::cerr << "usage:  ./merge_results table.txt shard [ shard ... ]" << std::endl;
+        return 1;
+    }
+
+    std::vector< cn_record > records;
+    int bad_shards = 0;
+    for( int i = 2; i < argc; i++ )
+    {
+        size_t before = records.size();
+        if( !read_shard( argv[i], records ) )
+        {
+            std::cerr << argv[i] << ": unreadable, torn, or corrupt past record " << records.size() - before << std::endl;
+            bad_shards++;
+        }
+    }
+
+    std::sort( records.begin(), records.end(), []( const cn_record& a, const cn_record& b ) { return a.n < b.n; } );
+
+    std::ofstream table( argv[1] );
+    uint64_t duplicates = 0;
+    uint64_t by_d[ MAX_PRIME_FACTORS + 1 ] = {};
+    for( size_t i = 0; i < records.size(); i++ )
+    {
+        if( i > 0 && records[i].n == records[i-1].n )
+        {
+            std::cerr << "duplicate " << to_string_128( records[i].n ) << " from jobs " << records[i-1].job_id << " and " << records[i].job_id << std::endl;
+            duplicates++;
+            continue;
+        }
+        table << to_string_128( records[i].n );
+        for( uint16_t j = 0; j < records[i].prime_count; j++ ) { table << " " << records[i].primes[j]; }
+        table << "\n";
+        by_d[ records[i].prime_count ]++;
+    }
+    table.close();
+
+    std::cout << records.size() - duplicates << " CN written to " << argv[1] << ", " << duplicates << " duplicates" << std::endl;
+    for( int d = 0; d <= MAX_PRIME_FACTORS; d++ )
+    {
+        if( by_d[d] > 0 ) { std::cout << "  d = " << d << ": " << by_d[d] << std::endl; }
+    }
+    return ( bad_shards > 0 || duplicates > 0 ) ? 1 : 0;
+}
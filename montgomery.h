@@ -0,0 +1,197 @@
+#ifndef MONTGOMERY_H
+#define MONTGOMERY_H
+
+#include <cstdint>
+#include <gmp.h>
+
+// Fermat tests for odd n < 2^96 in Montgomery arithmetic on 64-bit limbs
+// n = P*R < B in CN_search, so for B up to about 10^28 the tests do not need mpz_powm
+// n < 2^64 takes one limb with R = 2^64, larger n two limbs with R = 2^128
+// the bases are the small primes dividing L:
+//   base 2 multiplies by doubling, a shift and a subtraction, so a power of 2 costs only its squarings
+//   the other bases go through a sliding window of width MONTGOMERY_WINDOW on their odd powers
+// kept in a header so the hot loops can inline it
+
+typedef unsigned __int128 uint128_t;
+
+// n has to be below 2^MONTGOMERY_BITS for montgomery::set_modulus
+#define MONTGOMERY_BITS 96
+// 4 bits is about right for exponents around 80 bits:  8 odd powers and about 16 multiplies
+#define MONTGOMERY_WINDOW 4
+
+struct montgomery
+{
+    uint128_t n;
+    uint64_t n0, n1;        // the limbs of n
+    uint64_t n0_inverse;    // -n^{-1} mod 2^64
+    uint128_t one;          // R mod n, i.e. 1 in Montgomery form
+
+    // n odd and below 2^MONTGOMERY_BITS
+    void set_modulus( uint128_t init_n )
+    {
+        n = init_n;
+        n0 = n;
+        n1 = n >> 64;
+        // Newton's iteration doubles the correct low bits of n^{-1}, n*n = 1 mod 8 to start
+        uint64_t inverse = n0;
+        for( int i = 0; i < 5; i++ ) { inverse *= 2 - n0*inverse; }
+        n0_inverse = -inverse;
+        one = ( n1 == 0 ) ? ( (uint128_t) 1 << 64 ) % n0 : -n % n;
+    }
+
+    // a*b/R mod n for a, b < n
+    // one or two rounds of word-by-word Montgomery reduction
+    // a, b, n < 2^96 keep every high limb below 2^32, so no sum overflows
+    template< int limbs >
+    inline uint128_t multiply( uint128_t a, uint128_t b ) const
+    {
+        if( limbs == 1 )
+        {
+            uint128_t t = (uint128_t) (uint64_t) a * (uint64_t) b;
+            uint64_t m = (uint64_t) t * n0_inverse;
+            // t + m*n0 = 0 mod 2^64 carries out of the low limb unless t = 0 mod 2^64
+            uint128_t result = ( t >> 64 ) + ( ( (uint128_t) m * n0 ) >> 64 ) + ( (uint64_t) t != 0 );
+            return ( result >= n0 ) ? result - n0 : result;
+        }
+
+        uint64_t a0 = a, a1 = a >> 64, b0 = b, b1 = b >> 64;
+
+        uint128_t t = (uint128_t) a0 * b0;
+        uint64_t t0 = t;
+        t = (uint128_t) a1 * b0 + ( t >> 64 );
+        uint64_t t1 = t, t2 = t >> 64;
+        uint64_t m = t0 * n0_inverse;
+        t = ( (uint128_t) m * n0 + t0 ) >> 64;
+        t = (uint128_t) m * n1 + t1 + t;
+        t0 = t;
+        t = (uint128_t) t2 + ( t >> 64 );
+        t1 = t;
+
+        t = (uint128_t) a0 * b1 + t0;
+        t0 = t;
+        t = (uint128_t) a1 * b1 + t1 + ( t >> 64 );
+        t1 = t;
+        t2 = t >> 64;
+        m = t0 * n0_inverse;
+        t = ( (uint128_t) m * n0 + t0 ) >> 64;
+        t = (uint128_t) m * n1 + t1 + t;
+        uint128_t result = ( (uint128_t) ( t2 + (uint64_t) ( t >> 64 ) ) << 64 ) | (uint64_t) t;
+        return ( result >= n ) ? result - n : result;
+    }
+
+    // 2a mod n for a < n
+    // 2a >= n half the time, so the subtraction is undone with a mask and not a branch
+    inline uint128_t twice( uint128_t a ) const
+    {
+        uint128_t r = ( a << 1 ) - n;
+        return r + ( n & -( r >> 127 ) );
+    }
+
+    // a in Montgomery form, a < 2^32
+    inline uint128_t to_montgomery( uint64_t a ) const { return ( a*one ) % n; }
+
+    inline uint128_t from_montgomery( uint128_t a ) const { return ( n1 == 0 ) ? multiply<1>( a, 1 ) : multiply<2>( a, 1 ); }
+
+    // the index of the leading bit of a > 0
+    static inline int top_bit( uint128_t a )
+    {
+        return ( a >> 64 ) ? 127 - __builtin_clzll( (uint64_t) ( a >> 64 ) ) : 63 - __builtin_clzll( (uint64_t) a );
+    }
+
+    // 2^exponent in Montgomery form
+    template< int limbs >
+    uint128_t power_of_2( uint128_t exponent ) const
+    {
+        if( exponent == 0 ) { return one; }
+        int i = top_bit( exponent );
+
+        // the leading 5 bits are done by doubling alone
+        int lead = ( i >= 4 ) ? i - 4 : 0;
+        uint32_t lead_bits = exponent >> lead;
+        uint128_t x = one;
+        for( uint32_t j = 0; j < lead_bits; j++ ) { x = twice( x ); }
+        for( i = lead - 1; i >= 0; i-- )
+        {
+            x = multiply<limbs>( x, x );
+            uint128_t doubled = twice( x );
+            x = ( ( exponent >> i ) & 1 ) ? doubled : x;
+        }
+        return x;
+    }
+
+    // base^exponent in Montgomery form, base < 2^32
+    template< int limbs >
+    uint128_t power( uint64_t base, uint128_t exponent ) const
+    {
+        if( base == 2 ) { return power_of_2<limbs>( exponent ); }
+        if( exponent == 0 ) { return one; }
+
+        // base, base^3, ..., base^( 2^MONTGOMERY_WINDOW - 1 )
+        uint128_t odd_powers[ 1 << ( MONTGOMERY_WINDOW - 1 ) ];
+        odd_powers[0] = to_montgomery( base );
+        uint128_t base_squared = multiply<limbs>( odd_powers[0], odd_powers[0] );
+        for( int j = 1; j < ( 1 << ( MONTGOMERY_WINDOW - 1 ) ); j++ ) { odd_powers[j] = multiply<limbs>( odd_powers[ j-1 ], base_squared ); }
+
+        int i = top_bit( exponent );
+        uint128_t x = one;
+        bool started = false;
+        while( i >= 0 )
+        {
+            if( !( ( exponent >> i ) & 1 ) )
+            {
+                x = multiply<limbs>( x, x );
+                i--;
+                continue;
+            }
+            // the window is bit i down to the lowest set bit within MONTGOMERY_WINDOW bits
+            int low = ( i >= MONTGOMERY_WINDOW - 1 ) ? i - MONTGOMERY_WINDOW + 1 : 0;
+            while( !( ( exponent >> low ) & 1 ) ) { low++; }
+            uint32_t window = ( exponent >> low ) & ( ( 1u << ( i - low + 1 ) ) - 1 );
+            if( started )
+            {
+                for( int j = low; j <= i; j++ ) { x = multiply<limbs>( x, x ); }
+                x = multiply<limbs>( x, odd_powers[ window >> 1 ] );
+            }
+            else
+            {
+                x = odd_powers[ window >> 1 ];
+                started = true;
+            }
+            i = low - 1;
+        }
+        return x;
+    }
+
+    template< int limbs >
+    inline bool fermat_test( uint64_t base, int exp_on_2, uint128_t& strong_result ) const
+    {
+        strong_result = power<limbs>( base, ( n - 1 ) >> exp_on_2 );
+        uint128_t x = strong_result;
+        for( int j = 0; j < exp_on_2; j++ ) { x = multiply<limbs>( x, x ); }
+        return x == one;
+    }
+
+    // n is a Fermat pseudoprime to base:  base^(n-1) = 1 mod n, for 2^exp_on_2 dividing n-1
+    // strong_result is left as base^( (n-1)/2^exp_on_2 ) in Montgomery form, as fermat_test leaves it
+    inline bool fermat_test( uint64_t base, int exp_on_2, uint128_t& strong_result ) const
+    {
+        return ( n1 == 0 ) ? fermat_test<1>( base, exp_on_2, strong_result ) : fermat_test<2>( base, exp_on_2, strong_result );
+    }
+};
+
+// op for 0 <= op < 2^128
+inline uint128_t mpz_get_uint128( const mpz_t op )
+{
+    uint64_t limbs[2] = { 0, 0 };
+    mpz_export( limbs, 0, -1, sizeof( uint64_t ), 0, 0, op );
+    return ( (uint128_t) limbs[1] << 64 ) | limbs[0];
+}
+
+// rop = a for a < 2^128
+inline void mpz_set_uint128( mpz_t rop, uint128_t a )
+{
+    uint64_t limbs[2] = { (uint64_t) a, (uint64_t) ( a >> 64 ) };
+    mpz_import( rop, 2, -1, sizeof( uint64_t ), 0, 0, limbs );
+}
+
+#endif
@@ -0,0 +1,65 @@
+#include "placement.h"
+#include <sched.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+static thread_local int current_node = 0;
+
+// the CPUs of a sysfs cpulist like "0-3,8-11", false if the file is missing or empty
+static bool read_cpulist( const std::string& path, cpu_set_t& cpus )
+{
+    std::ifstream file( path );
+    std::string list;
+    if( !std::getline( file, list ) ) { return false; }
+
+    CPU_ZERO( &cpus );
+    bool any = false;
+    std::istringstream ranges( list );
+    std::string range;
+    while( std::getline( ranges, range, ',' ) )
+    {
+        if( range.empty() ) { continue; }
+        size_t dash = range.find( '-' );
+        int first = std::stoi( range.substr( 0, dash ) );
+        int last = ( dash == std::string::npos ) ? first : std::stoi( range.substr( dash + 1 ) );
+        for( int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++ )
+        {
+            CPU_SET( cpu, &cpus );
+            any = true;
+        }
+    }
+    return any;
+}
+
+int numa_node_count()
+{
+    static const int count = []()
+    {
+        int nodes = 0;
+        cpu_set_t cpus;
+        while( nodes < NUMA_MAX_NODES && read_cpulist( "/sys/devices/system/node/node" + std::to_string( nodes ) + "/cpulist", cpus ) ) { nodes++; }
+        return ( nodes > 0 ) ? nodes : 1;
+    }();
+    return count;
+}
+
+int numa_worker_node( uint64_t t, uint64_t thread_count )
+{
+    return ( thread_count == 0 ) ? 0 : (int) ( t * numa_node_count() / thread_count );
+}
+
+bool numa_pin_thread( int node )
+{
+    cpu_set_t cpus;
+    if( node < 0 || node >= numa_node_count() ) { return false; }
+    if( !read_cpulist( "/sys/devices/system/node/node" + std::to_string( node ) + "/cpulist", cpus ) ) { return false; }
+    if( sched_setaffinity( 0, sizeof( cpus ), &cpus ) != 0 ) { return false; }
+    current_node = node;
+    return true;
+}
+
+int numa_current_node()
+{
+    return current_node;
+}
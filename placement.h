@@ -0,0 +1,62 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <cstdint>
+#include <vector>
+#include <mutex>
+
+// NUMA placement for the worker threads and the large read-only tables they share
+// on a two-socket host a worker that reads a table from the other socket's memory loses bandwidth,
+// so with placement on, each worker is pinned to the CPUs of one node
+// and reads its own node's replica of each table
+//
+// the nodes and their CPUs come from /sys/devices/system/node, so no libnuma is needed
+// a replica is copied by the first worker of its node to use it, and Linux puts a page
+// on the node of the thread that first touches it, so the copy lands in that node's memory
+// on a single-node host, or with placement off, every thread reads the one original table
+//
+// e.g. in a driver with placement switched on:
+//   numa_pin_thread( numa_worker_node( t, thread_count ) );     // first thing in worker t
+//   const std::vector< job >& local_jobs = jobs.local();          // the replica on t's node
+
+// more nodes than this are folded onto the first NUMA_MAX_NODES
+#define NUMA_MAX_NODES 8
+
+// the number of nodes with CPUs, 1 if the host does not say
+int numa_node_count();
+
+// the node for worker t of thread_count:  workers are split into contiguous blocks, one per node
+int numa_worker_node( uint64_t t, uint64_t thread_count );
+
+// pins the calling thread to the CPUs of node and makes it the thread's node for node_replicas
+// returns false and leaves the thread where it was if node has no CPUs or the affinity call fails
+bool numa_pin_thread( int node );
+
+// the node the calling thread was pinned to, 0 if it never was
+int numa_current_node();
+
+// per-node copies of a read-only table, a std::vector with any allocator
+// node 0 reads the original, so without pinning nothing is copied
+template< class Table >
+class node_replicas
+{
+public:
+    // original has to outlive the replicas and not change while they are in use
+    node_replicas( const Table& init_original ) : original( init_original ) {}
+
+    // the copy on the calling thread's node, made on first use from that node
+    const Table& local()
+    {
+        int node = numa_current_node();
+        if( node == 0 ) { return original; }
+        std::call_once( made[ node ], [&]() { replicas[ node ] = original; } );
+        return replicas[ node ];
+    }
+
+private:
+    const Table& original;
+    Table replicas[ NUMA_MAX_NODES ];
+    std::once_flag made[ NUMA_MAX_NODES ];
+};
+
+#endif
@@ -0,0 +1,258 @@
+#include "results.h"
+#include "montgomery.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+void text_results::found( const mpz_t n, const uint64_t* primes, uint16_t count )
+{
+    char n_string[ 48 ];
+    mpz_get_str( n_string, 10, n );
+    output << n_string;
+    for( uint16_t j = 0; j < count; j++ ) { output << " " << primes[j]; }
+    output << "\n";
+}
+
+static void put_varint( std::vector< uint8_t >& buffer, unsigned __int128 value )
+{
+    while( value >= 0x80 )
+    {
+        buffer.push_back( (uint8_t) value | 0x80 );
+        value >>= 7;
+    }
+    buffer.push_back( (uint8_t) value );
+}
+
+// false if the varint runs past end or past 128 bits
+static bool get_varint( const uint8_t*& pos, const uint8_t* end, unsigned __int128& value )
+{
+    value = 0;
+    for( int shift = 0; pos < end && shift < 128; shift += 7 )
+    {
+        uint8_t byte = *pos++;
+        value |= (unsigned __int128) ( byte & 0x7f ) << shift;
+        if( !( byte & 0x80 ) ) { return true; }
+    }
+    return false;
+}
+
+static uint32_t fnv1a( const uint8_t* data, size_t length )
+{
+    uint32_t hash = 2166136261u;
+    for( size_t i = 0; i < length; i++ ) { hash = ( hash ^ data[i] ) * 16777619u; }
+    return hash;
+}
+
+result_writer::result_writer( const std::string& path )
+{
+    fd = open( path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644 );
+    if( fd < 0 ) { std::cerr << "cannot open result shard " << path << ": " << strerror( errno ) << std::endl; }
+    buffer.reserve( RESULT_SEGMENT_BYTES + 1024 );
+    buffer.resize( 16 );    // room for the segment header
+}
+
+result_writer::~result_writer()
+{
+    flush();
+    if( fd >= 0 ) { close( fd ); }
+}
+
+void result_writer::found( const mpz_t n, const uint64_t* primes, uint16_t count )
+{
+    uint64_t limbs[2] = { 0, 0 };
+    mpz_export( limbs, 0, -1, sizeof( uint64_t ), 0, 0, n );
+
+    put_varint( buffer, job_id );
+    buffer.push_back( (uint8_t) count );
+    put_varint( buffer, ( (unsigned __int128) limbs[1] << 64 ) | limbs[0] );
+    uint64_t previous = 0;
+    for( uint16_t j = 0; j < count; j++ )
+    {
+        put_varint( buffer, primes[j] - previous );
+        previous = primes[j];
+    }
+    buffered_records++;
+
+    if( buffer.size() >= RESULT_SEGMENT_BYTES ) { flush(); }
+}
+
+void result_writer::flush()
+{
+    if( buffered_records == 0 ) { return; }
+
+    uint32_t header[4] = { RESULT_MAGIC, buffered_records, (uint32_t) ( buffer.size() - 16 ), fnv1a( buffer.data() + 16, buffer.size() - 16 ) };
+    std::memcpy( buffer.data(), header, 16 );
+
+    // one write() per segment, retried only for the part a signal cut short
+    size_t written = 0;
+    while( fd >= 0 && written < buffer.size() )
+    {
+        ssize_t count = write( fd, buffer.data() + written, buffer.size() - written );
+        if( count < 0 && errno == EINTR ) { continue; }
+        if( count <= 0 )
+        {
+            std::cerr << "result shard write failed: " << strerror( errno ) << ", " << buffered_records << " records lost" << std::endl;
+            break;
+        }
+        written += count;
+    }
+    if( written == buffer.size() ) { records_written += buffered_records; }
+
+    buffer.resize( 16 );
+    buffered_records = 0;
+}
+
+void locked_sink::found( const mpz_t n, const uint64_t* primes, uint16_t count )
+{
+    std::lock_guard< std::mutex > guard( lock );
+    output.job_id = job_id;
+    output.found( n, primes, count );
+}
+
+void pipeline_sink::push( const result_message& message )
+{
+    while( !ring.push( message ) ) { std::this_thread::yield(); }
+}
+
+void pipeline_sink::found( const mpz_t n, const uint64_t* primes, uint16_t count )
+{
+    result_message message;
+    message.is_telemetry = false;
+    uint64_t limbs[2] = { 0, 0 };
+    mpz_export( limbs, 0, -1, sizeof( uint64_t ), 0, 0, n );
+    message.record.n = ( (unsigned __int128) limbs[1] << 64 ) | limbs[0];
+    message.record.job_id = job_id;
+    message.record.prime_count = count;
+    std::copy( primes, primes + count, message.record.primes );
+    push( message );
+}
+
+void pipeline_sink::job_done( unsigned __int128 P, unsigned __int128 L, uint64_t b )
+{
+    if( !TELEMETRY_ENABLED ) { return; }
+    result_message message;
+    message.is_telemetry = true;
+    message.record.job_id = job_id;
+    message.P = P;
+    message.L = L;
+    message.b = b;
+    telemetry_job_counts( message.counts );
+    push( message );
+}
+
+result_pipeline::result_pipeline( result_sink& init_output, std::ostream* init_telemetry_log )
+    : output( init_output ), telemetry_log( init_telemetry_log )
+{
+    writer = std::thread( &result_pipeline::write_loop, this );
+}
+
+result_pipeline::~result_pipeline()
+{
+    stop();
+    for( int i = 0; i < worker_count.load(); i++ ) { delete workers[i]; }
+}
+
+pipeline_sink& result_pipeline::add_worker()
+{
+    int i = worker_count.load( std::memory_order_relaxed );
+    if( i == PIPELINE_MAX_WORKERS )
+    {
+        std::cerr << "result_pipeline:  more than " << PIPELINE_MAX_WORKERS << " workers" << std::endl;
+        exit( 1 );
+    }
+    workers[i] = new pipeline_sink;
+    // the writer thread sees the new ring only once the count is published
+    worker_count.store( i + 1, std::memory_order_release );
+    return *workers[i];
+}
+
+void result_pipeline::stop()
+{
+    if( !writer.joinable() ) { return; }
+    stopping.store( true, std::memory_order_release );
+    writer.join();
+}
+
+void result_pipeline::write_loop()
+{
+    result_message message;
+    mpz_t n;
+    mpz_init( n );
+    while( true )
+    {
+        // read before the sweep, so the sweep after stop() sees everything the workers pushed
+        bool last_sweep = stopping.load( std::memory_order_acquire );
+        bool idle = true;
+        int count = worker_count.load( std::memory_order_acquire );
+        for( int i = 0; i < count; i++ )
+        {
+            while( workers[i]->ring.pop( message ) )
+            {
+                idle = false;
+                if( message.is_telemetry )
+                {
+                    if( telemetry_log != nullptr )
+                    {
+                        telemetry_write_job( *telemetry_log, message.record.job_id, message.P, message.L, message.b, message.counts );
+                    }
+                    continue;
+                }
+                mpz_set_uint128( n, message.record.n );
+                output.job_id = message.record.job_id;
+                output.found( n, message.record.primes, message.record.prime_count );
+            }
+        }
+        if( last_sweep ) { break; }
+        if( idle ) { std::this_thread::sleep_for( std::chrono::microseconds( PIPELINE_IDLE_MICROSECONDS ) ); }
+    }
+    mpz_clear( n );
+    output.flush();
+    if( telemetry_log != nullptr ) { telemetry_log->flush(); }
+}
+
+bool read_shard( const std::string& path, std::vector< cn_record >& records )
+{
+    std::ifstream file( path, std::ios::binary );
+    if( !file ) { return false; }
+    std::vector< uint8_t > data( ( std::istreambuf_iterator< char >( file ) ), std::istreambuf_iterator< char >() );
+
+    size_t offset = 0;
+    while( offset < data.size() )
+    {
+        uint32_t header[4];
+        if( data.size() - offset < 16 ) { return false; }
+        std::memcpy( header, data.data() + offset, 16 );
+        offset += 16;
+        if( header[0] != RESULT_MAGIC || data.size() - offset < header[2] ) { return false; }
+        if( fnv1a( data.data() + offset, header[2] ) != header[3] ) { return false; }
+
+        const uint8_t* pos = data.data() + offset;
+        const uint8_t* end = pos + header[2];
+        for( uint32_t i = 0; i < header[1]; i++ )
+        {
+            cn_record record;
+            unsigned __int128 value;
+            if( !get_varint( pos, end, value ) || pos == end ) { return false; }
+            record.job_id = value;
+            record.prime_count = *pos++;
+            if( record.prime_count > MAX_PRIME_FACTORS || !get_varint( pos, end, record.n ) ) { return false; }
+            uint64_t previous = 0;
+            for( uint16_t j = 0; j < record.prime_count; j++ )
+            {
+                if( !get_varint( pos, end, value ) ) { return false; }
+                previous += value;
+                record.primes[j] = previous;
+            }
+            records.push_back( record );
+        }
+        offset += header[2];
+    }
+    return true;
+}
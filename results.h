@@ -0,0 +1,181 @@
+#ifndef RESULTS_H
+#define RESULTS_H
+
+#include "Preproduct.h"
+#include "telemetry.h"
+#include "spsc_ring.h"
+#include <gmp.h>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+
+// where CN_search sends each CN it finds
+// a CN comes with its prime factors in increasing order, and the id of the job that found it
+// the caller sets job_id before it runs a job
+//
+// text_results writes the lines verify reads:  n followed by its prime factors
+// result_writer writes a binary shard, one per thread, that merge_results turns into the final table
+// result_pipeline hands the CN of many threads to one writer thread, which passes them on to one of these
+
+class result_sink
+{
+public:
+    uint64_t job_id = 0;
+
+    virtual ~result_sink() {}
+    virtual void found( const mpz_t n, const uint64_t* primes, uint16_t count ) = 0;
+
+    // called when job_id is done, with this thread's telemetry since telemetry_job_begin
+    // the job is {P, L, b}, which only some sinks record
+    virtual void job_done( unsigned __int128 /* P */, unsigned __int128 /* L */, uint64_t /* b */ ) {}
+
+    // writes out anything buffered
+    virtual void flush() {}
+};
+
+class text_results : public result_sink
+{
+public:
+    text_results( std::ostream& init_output ) : output( init_output ) {}
+    void found( const mpz_t n, const uint64_t* primes, uint16_t count );
+    void flush() { output.flush(); }
+
+private:
+    std::ostream& output;
+};
+
+// a result_sink that several threads send their CN to at once, passing them on to output under a lock
+// for the appending tree of one job run on several threads, whose CN are few next to its work
+// the caller sets job_id, which goes on to output with each CN
+class locked_sink : public result_sink
+{
+public:
+    locked_sink( result_sink& init_output ) : output( init_output ) {}
+    void found( const mpz_t n, const uint64_t* primes, uint16_t count );
+
+private:
+    result_sink& output;
+    std::mutex lock;
+};
+
+// one CN as it is stored in a shard
+// n < B <= 10^24 fits in 128 bits, and d = prime_count
+struct cn_record
+{
+    unsigned __int128 n;
+    uint64_t job_id;
+    uint16_t prime_count;
+    uint64_t primes[ MAX_PRIME_FACTORS ];
+};
+
+// the shard format
+// a shard is a sequence of segments, each a header and then its records:
+//   header:   "CNR1", record count, payload length in bytes, FNV-1a hash of the payload, 4 bytes each
+//   record:   job id, d, n, then the first prime and the gap to each next prime, all LEB128 varints but d
+// the primes are increasing, so the gaps are small and most of a record is n
+// a segment goes to the file in one write(), so a crash can only leave a torn last segment,
+// which read_shard drops
+#define RESULT_SEGMENT_BYTES 65'536
+#define RESULT_MAGIC 0x3152'4E43    // "CNR1" read as a little-endian uint32_t
+
+// buffers the records of one thread and commits them to its shard a segment at a time
+// appends to the shard if it already exists, e.g. after a restart
+class result_writer : public result_sink
+{
+public:
+    result_writer( const std::string& path );
+    ~result_writer();
+    result_writer( const result_writer& ) = delete;
+    result_writer& operator=( const result_writer& ) = delete;
+
+    void found( const mpz_t n, const uint64_t* primes, uint16_t count );
+
+    // commits the buffered records as one segment
+    void flush();
+
+    uint64_t records_written = 0;
+
+private:
+    int fd;
+    std::vector< uint8_t > buffer;
+    uint32_t buffered_records = 0;
+};
+
+// the CN_search of many threads send their CN and job telemetry to one writer thread
+// each worker thread pushes into its own single-producer single-consumer ring,
+// so a worker never takes a lock or waits on another worker, and never does I/O itself
+// the writer thread drains every ring in turn into output, and the job telemetry into telemetry_log
+//
+//   result_pipeline pipeline( shard );
+//   for each thread:  Tabulation tabulation( ..., pipeline.add_worker() );
+//   ...
+//   pipeline.stop();    // after the workers are done:  drains the rings and joins the writer thread
+
+// slots in each worker's ring, a power of 2
+// CN are rare next to the time CN_search spends per candidate, so a ring only fills
+// when the writer thread is starved of a core;  then the worker yields until there is room
+#define RESULT_RING_SLOTS 4096
+#define PIPELINE_MAX_WORKERS 256
+// how long the writer thread sleeps when every ring is empty
+#define PIPELINE_IDLE_MICROSECONDS 200
+
+struct result_message
+{
+    bool is_telemetry;
+    cn_record record;               // the CN, or just the job_id for telemetry
+    unsigned __int128 P, L;         // the job, for telemetry
+    uint64_t b;
+    telemetry_counters counts;
+};
+
+typedef spsc_ring< result_message, RESULT_RING_SLOTS > result_ring;
+
+// the result_sink of one worker thread
+class pipeline_sink : public result_sink
+{
+public:
+    void found( const mpz_t n, const uint64_t* primes, uint16_t count );
+    void job_done( unsigned __int128 P, unsigned __int128 L, uint64_t b );
+
+    result_ring ring;
+
+private:
+    void push( const result_message& message );
+};
+
+class result_pipeline
+{
+public:
+    // telemetry_log may be null, job telemetry is then dropped
+    result_pipeline( result_sink& init_output, std::ostream* init_telemetry_log = nullptr );
+    ~result_pipeline();
+    result_pipeline( const result_pipeline& ) = delete;
+    result_pipeline& operator=( const result_pipeline& ) = delete;
+
+    // a sink for one more worker thread, valid until the pipeline is destroyed
+    // called from the thread that owns the pipeline, at most PIPELINE_MAX_WORKERS times
+    pipeline_sink& add_worker();
+
+    // drains the rings once the workers are done pushing, flushes output, and joins the writer thread
+    void stop();
+
+private:
+    result_sink& output;
+    std::ostream* telemetry_log;
+    pipeline_sink* workers[ PIPELINE_MAX_WORKERS ];
+    std::atomic< int > worker_count{ 0 };
+    std::atomic< bool > stopping{ false };
+    std::thread writer;
+
+    void write_loop();
+};
+
+// appends the records of every intact segment of the shard at path
+// returns false if the file cannot be read or ends in a torn or corrupt segment
+bool read_shard( const std::string& path, std::vector< cn_record >& records );
+
+#endif
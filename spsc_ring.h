@@ -0,0 +1,43 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// a bounded single-producer single-consumer queue with no locks
+// the producer only writes tail and the consumer only writes head, each on its own cache line,
+// so neither waits on the other unless the ring is full or empty;  push and pop then return false
+// and the caller decides how to wait, which is how backpressure reaches the stage before
+// Slots has to be a power of 2
+template< class T, size_t Slots >
+class spsc_ring
+{
+public:
+    static_assert( ( Slots & ( Slots - 1 ) ) == 0, "spsc_ring needs a power of 2 slots" );
+
+    bool push( const T& message )
+    {
+        uint64_t t = tail.load( std::memory_order_relaxed );
+        if( t - head.load( std::memory_order_acquire ) == Slots ) { return false; }
+        slots[ t & ( Slots - 1 ) ] = message;
+        tail.store( t + 1, std::memory_order_release );
+        return true;
+    }
+
+    bool pop( T& message )
+    {
+        uint64_t h = head.load( std::memory_order_relaxed );
+        if( h == tail.load( std::memory_order_acquire ) ) { return false; }
+        message = slots[ h & ( Slots - 1 ) ];
+        head.store( h + 1, std::memory_order_release );
+        return true;
+    }
+
+private:
+    alignas( 64 ) std::atomic< uint64_t > head{ 0 };
+    alignas( 64 ) std::atomic< uint64_t > tail{ 0 };
+    alignas( 64 ) T slots[ Slots ];
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "telemetry.h"
+
+#ifdef CN_TELEMETRY
+
+#include "Precomputation.h"
+#include <mutex>
+#include <ostream>
+
+thread_local telemetry_counters telemetry = {};
+
+// the counts of this thread when its current job started
+static thread_local telemetry_counters job_start = {};
+
+static telemetry_counters totals = {};
+static std::mutex totals_mutex;
+
+static const char* phase_names[ TELEMETRY_PHASE_COUNT ] = { "initializing", "appending", "search", "factoring" };
+
+// writes the fields of counts - base as the inside of a JSON object
+static void write_fields( std::ostream& log, const telemetry_counters& counts, const telemetry_counters& base )
+{
+    log << "\"candidates_scanned\": " << counts.candidates_scanned - base.candidates_scanned;
+    log << ", \"candidates_sieved\": " << counts.candidates_sieved - base.candidates_sieved;
+    log << ", \"fermat_tests\": [";
+    for( int i = 0; i < TELEMETRY_BASES; i++ )
+    {
+        log << ( i ? ", " : "" ) << counts.fermat_tests[i] - base.fermat_tests[i];
+    }
+    log << "]";
+    log << ", \"pseudoprimes\": " << counts.pseudoprimes - base.pseudoprimes;
+    log << ", \"factor_splits\": " << counts.factor_splits - base.factor_splits;
+    log << ", \"admissible_slow_steps\": " << counts.admissible_slow_steps - base.admissible_slow_steps;
+    log << ", \"ns\": {";
+    for( int i = 0; i < TELEMETRY_PHASE_COUNT; i++ )
+    {
+        log << ( i ? ", " : " " ) << "\"" << phase_names[i] << "\": " << counts.phase_ns[i] - base.phase_ns[i];
+    }
+    log << " }";
+}
+
+void telemetry_job_begin()
+{
+    job_start = telemetry;
+}
+
+void telemetry_job_end( std::ostream& log, uint64_t job_id, unsigned __int128 P, unsigned __int128 L, uint64_t b )
+{
+    telemetry_counters counts;
+    telemetry_job_counts( counts );
+    telemetry_write_job( log, job_id, P, L, b, counts );
+}
+
+void telemetry_job_counts( telemetry_counters& counts )
+{
+    counts.candidates_scanned = telemetry.candidates_scanned - job_start.candidates_scanned;
+    counts.candidates_sieved = telemetry.candidates_sieved - job_start.candidates_sieved;
+    for( int i = 0; i < TELEMETRY_BASES; i++ ) { counts.fermat_tests[i] = telemetry.fermat_tests[i] - job_start.fermat_tests[i]; }
+    counts.pseudoprimes = telemetry.pseudoprimes - job_start.pseudoprimes;
+    counts.factor_splits = telemetry.factor_splits - job_start.factor_splits;
+    counts.admissible_slow_steps = telemetry.admissible_slow_steps - job_start.admissible_slow_steps;
+    for( int i = 0; i < TELEMETRY_PHASE_COUNT; i++ ) { counts.phase_ns[i] = telemetry.phase_ns[i] - job_start.phase_ns[i]; }
+}
+
+void telemetry_write_job( std::ostream& log, uint64_t job_id, unsigned __int128 P, unsigned __int128 L, uint64_t b, const telemetry_counters& counts )
+{
+    static const telemetry_counters zero = {};
+    log << "{ \"job\": " << job_id << ", \"P\": " << to_string_128( P ) << ", \"L\": " << to_string_128( L ) << ", \"b\": " << b << ", ";
+    write_fields( log, counts, zero );
+    log << " }\n";
+}
+
+void telemetry_merge()
+{
+    std::lock_guard< std::mutex > lock( totals_mutex );
+    totals.candidates_scanned += telemetry.candidates_scanned;
+    totals.candidates_sieved += telemetry.candidates_sieved;
+    for( int i = 0; i < TELEMETRY_BASES; i++ ) { totals.fermat_tests[i] += telemetry.fermat_tests[i]; }
+    totals.pseudoprimes += telemetry.pseudoprimes;
+    totals.factor_splits += telemetry.factor_splits;
+    totals.admissible_slow_steps += telemetry.admissible_slow_steps;
+    for( int i = 0; i < TELEMETRY_PHASE_COUNT; i++ ) { totals.phase_ns[i] += telemetry.phase_ns[i]; }
+    telemetry = {};
+    job_start = {};
+}
+
+void telemetry_write_totals( std::ostream& log )
+{
+    static const telemetry_counters zero = {};
+    std::lock_guard< std::mutex > lock( totals_mutex );
+    log << "{ \"totals\": true, ";
+    write_fields( log, totals, zero );
+    log << " }\n";
+}
+
+#endif
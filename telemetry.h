@@ -0,0 +1,120 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <cstdint>
+#include <chrono>
+#include <ostream>
+
+// counters for the hot paths of a job, to see whether a slow job is slow
+// because of sieving, modular exponentiation, or factoring
+// compiled in only with -DCN_TELEMETRY, e.g.
+//   make clean && make CPPFLAGS=-DCN_TELEMETRY
+// without it every TELEMETRY_ macro expands to nothing and the job functions are empty
+//
+// each thread counts into its own thread_local copy with no synchronization
+// a thread calls telemetry_merge when it is done to add its counts to the process totals
+
+// Fermat tests are counted by the index of the base in L_distinct_primes
+// the last one counts every base from it on, L rarely has more than 8 distinct primes
+#define TELEMETRY_BASES 8
+
+enum telemetry_phase
+{
+    PHASE_INITIALIZING,
+    PHASE_APPENDING,
+    PHASE_SEARCH,       // all of CN_search, factoring included
+    PHASE_FACTORING,    // splitting Fermat pseudoprimes
+    TELEMETRY_PHASE_COUNT
+};
+
+struct telemetry_counters
+{
+    uint64_t candidates_scanned;
+    uint64_t candidates_sieved;
+    uint64_t fermat_tests[ TELEMETRY_BASES ];
+    uint64_t pseudoprimes;
+    uint64_t factor_splits;
+    uint64_t admissible_slow_steps;   // passes through the while loop of is_admissible
+    uint64_t phase_ns[ TELEMETRY_PHASE_COUNT ];
+};
+
+#ifdef CN_TELEMETRY
+
+#define TELEMETRY_ENABLED 1
+
+extern thread_local telemetry_counters telemetry;
+
+#define TELEMETRY_ADD( field, amount ) ( telemetry.field += ( amount ) )
+// times the rest of the enclosing scope
+#define TELEMETRY_PHASE( phase ) telemetry_phase_timer telemetry_timer_##phase( phase )
+
+class telemetry_phase_timer
+{
+public:
+    telemetry_phase_timer( telemetry_phase init_phase ) : phase( init_phase ), start( std::chrono::steady_clock::now() ) {}
+    ~telemetry_phase_timer()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        telemetry.phase_ns[ phase ] += std::chrono::duration_cast< std::chrono::nanoseconds >( elapsed ).count();
+    }
+private:
+    telemetry_phase phase;
+    std::chrono::steady_clock::time_point start;
+};
+
+// times a stretch of work whose time is added to a phase later with TELEMETRY_ADD( phase_ns[ phase ], ... ),
+// once the record of the job it belongs to is open
+class telemetry_stopwatch
+{
+public:
+    telemetry_stopwatch() : start( std::chrono::steady_clock::now() ) {}
+    uint64_t elapsed_ns() const
+    {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration_cast< std::chrono::nanoseconds >( elapsed ).count();
+    }
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+// marks the start of a job on this thread
+void telemetry_job_begin();
+
+// writes one JSON line with this thread's counts since telemetry_job_begin
+void telemetry_job_end( std::ostream& log, uint64_t job_id, unsigned __int128 P, unsigned __int128 L, uint64_t b );
+
+// this thread's counts since telemetry_job_begin, to be written by another thread
+void telemetry_job_counts( telemetry_counters& counts );
+
+// the JSON line of telemetry_job_end for counts taken with telemetry_job_counts
+void telemetry_write_job( std::ostream& log, uint64_t job_id, unsigned __int128 P, unsigned __int128 L, uint64_t b, const telemetry_counters& counts );
+
+// adds this thread's counts to the process totals and zeroes them
+void telemetry_merge();
+
+// writes the process totals as one JSON line
+void telemetry_write_totals( std::ostream& log );
+
+#else
+
+#define TELEMETRY_ENABLED 0
+
+#define TELEMETRY_ADD( field, amount ) ( (void) 0 )
+#define TELEMETRY_PHASE( phase ) ( (void) 0 )
+
+class telemetry_stopwatch
+{
+public:
+    uint64_t elapsed_ns() const { return 0; }
+};
+
+inline void telemetry_job_begin() {}
+inline void telemetry_job_end( std::ostream&, uint64_t, unsigned __int128, unsigned __int128, uint64_t ) {}
+inline void telemetry_job_counts( telemetry_counters& ) {}
+inline void telemetry_write_job( std::ostream&, uint64_t, unsigned __int128, unsigned __int128, uint64_t, const telemetry_counters& ) {}
+inline void telemetry_merge() {}
+inline void telemetry_write_totals( std::ostream& ) {}
+
+#endif
+
+#endif
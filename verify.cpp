@@ -0,0 +1,386 @@
+// correctness oracle for the full pipeline
+// runs the precomputation and Tabulation at a small bound B = 10^k
+// and compares the CN found against a slow reference search for the same bound
+//
+// the reference does not use the precomputation, the appending tree, or CN_search:
+// it walks every cyclic P = p_1 < ... < p_j with j >= 2 and P*p_j^2 < B,
+// and every possible last prime q > p_j with q = P^{-1} mod L, q <= P and P*q < B
+// each P*q is checked with appending_is_CN, and cross-checked with is_CN
+//
+// also compares the count to the known counts of CN up to 10^k
+// exits with status 1 on any missing, extra, or duplicated CN
+//
+// a small preproduct with a long progression appends every prime up to sqrt( B/P ), see Precomputation::append_limit,
+// so no job steps through its B/(P*L) candidates and the time grows about 5 times for each k
+// on one core k = 12 takes about 15 s and k = 13 about 75 s for the pipeline, and half that for the reference,
+// so make check-large runs those, and k = 14 or 15 is for a longer run by hand
+//
+// with more than one thread the jobs are split between worker threads,
+// whose CN go through a result_pipeline to a single writer thread
+// with numa = 1 each worker is pinned to a NUMA node and reads that node's copy of the job lists,
+// see placement.h;  on a single-node host this changes nothing
+//
+// with fermat workers > 0 the long CN_search calls run as a pipeline with that many Fermat threads,
+// see Preproduct::CN_search_staged;  build with CPPFLAGS=-DCN_STAGED_MIN_CANDIDATES=1 to stage every one
+// with tree workers > 0 the appending tree of each job is walked by that many more threads, see Tabulation::visit
+//
+// built with CPPFLAGS=-DCN_TELEMETRY, one JSON line per job and then the totals go to the telemetry log, see telemetry.h
+//
+// with an output prefix the CN are also written as a text table to prefix.txt, in the order found,
+// and as result shards prefix.shard.0, ... one per thread, each CN to the shard of its job id mod threads
+// merge_results on the shards has to give the text table sorted by n, which make check compares
+// shards are appended to, so remove old ones first
+//
+// ./verify montgomery checks montgomery::fermat_test against mpz_powm on random moduli of 65 to MONTGOMERY_BITS bits
+// every n = P*R below B <= 10^18 fits in one limb, so the runs above never reach the two-limb kernels
+//
+// usage:  ./verify [ k, default 9 ] [ n, default 4 ] [ C, default 1 ] [ threads, default 1 ] [ numa, default 0 ] [ fermat workers, default 0 ]
+//                  [ tree workers, default 0 ] [ telemetry log, default verify_telemetry.jsonl ] [ output prefix, default none ]
+//         ./verify montgomery [ moduli, default VERIFY_MONTGOMERY_MODULI ]
+
+#include "Preproduct.h"
+#include "Precomputation.h"
+#include "Tabulation.h"
+#include "results.h"
+#include "placement.h"
+#include "montgomery.h"
+#include <gmp.h>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <vector>
+#include <array>
+#include <thread>
+#include <memory>
+
+// the number of CN up to 10^k, from Pinch's tables
+static const uint64_t known_counts[] = { 0, 0, 0, 1, 7, 16, 43, 105, 255, 646, 1547, 3605, 8241, 19279, 44706, 105212, 246683, 585355, 1401644 };
+#define VERIFY_MAX_EXPONENT 18
+
+// random moduli for ./verify montgomery, each tested with every base below
+#define VERIFY_MONTGOMERY_MODULI 20'000
+// CN_search takes its Fermat bases from the small primes dividing L
+static const uint64_t montgomery_bases[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47 };
+
+// compares montgomery::fermat_test to mpz_powm on moduli odd n of 65 to MONTGOMERY_BITS bits
+// half of the n are primes, so that the Fermat test also passes
+// exp_on_2 is random up to the power of 2 dividing n-1
+// returns the number of tests whose result or strong_result disagree
+uint64_t check_montgomery( uint64_t moduli )
+{
+    gmp_randstate_t state;
+    gmp_randinit_default( state );
+    gmp_randseed_ui( state, 2024 );
+    mpz_t n, n_minus_1, exponent, base, expected;
+    mpz_init( n );
+    mpz_init( n_minus_1 );
+    mpz_init( exponent );
+    mpz_init( base );
+    mpz_init( expected );
+    montgomery mont;
+    uint64_t failures = 0;
+
+    for( uint64_t i = 0; i < moduli; i++ )
+    {
+        uint64_t bits = 65 + gmp_urandomm_ui( state, MONTGOMERY_BITS - 64 );
+        do
+        {
+            mpz_urandomb( n, state, bits );
+            mpz_setbit( n, bits - 1 );
+            mpz_setbit( n, 0 );
+            if( i % 2 == 1 ) { mpz_nextprime( n, n ); }
+        } while( mpz_sizeinbase( n, 2 ) > MONTGOMERY_BITS );
+        mpz_sub_ui( n_minus_1, n, 1 );
+        int exp_on_2 = gmp_urandomm_ui( state, mpz_scan1( n_minus_1, 0 ) + 1 );
+        mpz_tdiv_q_2exp( exponent, n_minus_1, exp_on_2 );
+        mont.set_modulus( mpz_get_uint128( n ) );
+
+        for( auto b : montgomery_bases )
+        {
+            uint128_t strong_result;
+            bool is_fermat_psp = mont.fermat_test( b, exp_on_2, strong_result );
+            mpz_set_ui( base, b );
+            mpz_powm( expected, base, exponent, n );
+            bool strong_agrees = ( mont.from_montgomery( strong_result ) == mpz_get_uint128( expected ) );
+            mpz_powm( expected, base, n_minus_1, n );
+            bool fermat_agrees = ( is_fermat_psp == ( mpz_cmp_ui( expected, 1 ) == 0 ) );
+            if( !strong_agrees || !fermat_agrees )
+            {
+                if( failures < 10 ) { gmp_printf( "  base %lu, exp_on_2 %d and n = %Zd disagree with mpz_powm\n", b, exp_on_2, n ); }
+                failures++;
+            }
+        }
+    }
+
+    mpz_clear( n );
+    mpz_clear( n_minus_1 );
+    mpz_clear( exponent );
+    mpz_clear( base );
+    mpz_clear( expected );
+    gmp_randclear( state );
+    return failures;
+}
+
+struct reference_search
+{
+    uint64_t B;
+    std::vector< bool > is_prime;       // up to sqrt( B )
+    std::vector< uint32_t > primes;
+    std::vector< uint64_t > found;
+    uint64_t disagreements = 0;         // appending_is_CN and is_CN gave different answers
+
+    Preproduct prefix;
+    Preproduct full;
+
+    // the prime factors of the current P
+    std::vector< uint64_t > factors;
+
+    // a^{-1} mod m, assumes gcd( a, m ) = 1
+    static uint64_t inverse_mod( uint64_t a, uint64_t m )
+    {
+        __int128 t = 0, new_t = 1;
+        __int128 r = m, new_r = a % m;
+        while( new_r != 0 )
+        {
+            __int128 q = r / new_r;
+            std::swap( t, new_t );
+            new_t -= q*t;
+            std::swap( r, new_r );
+            new_r -= q*r;
+        }
+        return ( t < 0 ) ? t + m : t;
+    }
+
+    // the last prime q of a CN P*q
+    void last_primes( uint64_t P, uint64_t L )
+    {
+        // q - 1 divides P*q - 1, so q - 1 divides P - 1 and q <= P
+        uint64_t q_bound = std::min( P, ( B - 1 ) / P );
+        if( q_bound <= factors.back() ) { return; }
+
+        mpz_set_ui( prefix.P, P );
+        mpz_set_ui( prefix.L, L );
+        std::copy( factors.begin(), factors.end(), prefix.P_primes );
+        prefix.P_len = factors.size();
+
+        uint64_t q = inverse_mod( P, L );
+        if( q <= factors.back() ) { q += ( ( factors.back() - q ) / L + 1 ) * L; }
+        for( ; q <= q_bound; q += L )
+        {
+            if( !is_prime[q] ) { continue; }
+            std::vector< uint64_t > append = { q };
+            bool by_appending = prefix.appending_is_CN( append );
+
+            mpz_set_ui( full.P, P*q );
+            mpz_set_ui( full.L, std::lcm( L, q - 1 ) );
+            bool by_lambda = full.is_CN();
+            // is_CN does not check admissibility, for cyclic P*q the two agree
+            bool cyclic = true;
+            for( auto p : factors ) { cyclic = cyclic && ( q % p != 1 ); }
+
+            if( by_appending != ( by_lambda && cyclic ) ) { disagreements++; }
+            if( by_appending ) { found.push_back( P*q ); }
+        }
+    }
+
+    void walk( uint64_t P, uint64_t L, size_t start )
+    {
+        for( size_t i = start; i < primes.size(); i++ )
+        {
+            uint64_t p = primes[i];
+            // at least one more prime q > p is needed
+            if( (unsigned __int128) P*p*( p + 2 ) >= B ) { break; }
+            bool cyclic = true;
+            for( auto f : factors ) { cyclic = cyclic && ( p % f != 1 ); }
+            if( !cyclic ) { continue; }
+
+            factors.push_back( p );
+            uint64_t new_L = std::lcm( L, p - 1 );
+            if( factors.size() >= 2 ) { last_primes( P*p, new_L ); }
+            walk( P*p, new_L, i + 1 );
+            factors.pop_back();
+        }
+    }
+
+    void run( uint64_t init_B )
+    {
+        B = init_B;
+        uint64_t sqrt_B = (uint64_t) sqrt( (double) B ) + 1;
+        is_prime.assign( sqrt_B + 1, false );
+        primes = sieve_primes( 2, sqrt_B );
+        for( auto p : primes ) { is_prime[p] = true; }
+        walk( 1, 1, 0 );
+        std::sort( found.begin(), found.end() );
+    }
+};
+
+// passes each CN on to the text table and to the shard of its job
+class sharded_copy : public result_sink
+{
+public:
+    sharded_copy( result_sink& init_text, std::vector< std::unique_ptr< result_writer > >& init_shards )
+        : text( init_text ), shards( init_shards ) {}
+
+    void found( const mpz_t n, const uint64_t* primes, uint16_t count )
+    {
+        text.job_id = job_id;
+        text.found( n, primes, count );
+        if( shards.empty() ) { return; }
+        result_writer& shard = *shards[ job_id % shards.size() ];
+        shard.job_id = job_id;
+        shard.found( n, primes, count );
+    }
+
+    void flush()
+    {
+        text.flush();
+        for( auto& shard : shards ) { shard->flush(); }
+    }
+
+private:
+    result_sink& text;
+    std::vector< std::unique_ptr< result_writer > >& shards;
+};
+
+int main( int argc, char* argv[] )
+{
+    if( argc > 1 && std::string( argv[1] ) == "montgomery" )
+    {
+        uint64_t moduli = ( argc > 2 ) ? std::stoul( argv[2] ) : VERIFY_MONTGOMERY_MODULI;
+        uint64_t failures = check_montgomery( moduli );
+        std::cout << "montgomery::fermat_test on " << moduli << " moduli of 65 to " << MONTGOMERY_BITS << " bits and "
+                  << std::size( montgomery_bases ) << " bases:  " << failures << " disagreements with mpz_powm" << std::endl;
+        std::cout << ( failures == 0 ? "PASSED" : "FAILED" ) << std::endl;
+        return ( failures == 0 ) ? 0 : 1;
+    }
+
+    uint64_t bound_exponent = ( argc > 1 ) ? std::stoul( argv[1] ) : 9;
+    uint64_t p_exponent = ( argc > 2 ) ? std::stoul( argv[2] ) : 4;
+    uint64_t C_constant = ( argc > 3 ) ? std::stoul( argv[3] ) : 1;
+    uint64_t thread_count = ( argc > 4 ) ? std::max( std::stoul( argv[4] ), 1ul ) : 1;
+    bool numa = ( argc > 5 ) && std::stoul( argv[5] ) != 0;
+    uint16_t fermat_workers = ( argc > 6 ) ? std::stoul( argv[6] ) : 0;
+    uint16_t tree_workers = ( argc > 7 ) ? std::stoul( argv[7] ) : 0;
+    std::string telemetry_path = ( argc > 8 ) ? argv[8] : "verify_telemetry.jsonl";
+    std::string output_prefix = ( argc > 9 ) ? argv[9] : "";
+    if( bound_exponent < 3 || bound_exponent > VERIFY_MAX_EXPONENT )
+    {
+        std::cerr << "the bound exponent has to be between 3 and " << VERIFY_MAX_EXPONENT << std::endl;
+        return 1;
+    }
+    uint64_t B = 1;
+    for( uint64_t i = 0; i < bound_exponent; i++ ) { B *= 10; }
+
+    // the pipeline
+    auto t1 = std::chrono::steady_clock::now();
+    Precomputation tree( bound_exponent, p_exponent, C_constant );
+    tree.build( PRECOMPUTATION_PRIME_COUNT, false );
+
+    // the output jobs are numbered first, then the working jobs
+    // thread t takes the t-th contiguous chunk of the output jobs and every thread_count-th working job
+    std::ostringstream pipeline_output;
+    text_results pipeline_text( pipeline_output );
+    std::vector< std::unique_ptr< result_writer > > shards;
+    for( uint64_t t = 0; t < thread_count && !output_prefix.empty(); t++ )
+    {
+        shards.emplace_back( new result_writer( output_prefix + ".shard." + std::to_string( t ) ) );
+    }
+    sharded_copy pipeline_results( pipeline_text, shards );
+    std::ofstream telemetry_log;
+    if( TELEMETRY_ENABLED ) { telemetry_log.open( telemetry_path ); }
+    result_pipeline results( pipeline_results, TELEMETRY_ENABLED ? &telemetry_log : nullptr );
+    std::vector< std::unique_ptr< Tabulation > > tabulations;
+    for( uint64_t t = 0; t < thread_count; t++ )
+    {
+        tabulations.emplace_back( new Tabulation( bound_exponent, p_exponent, C_constant, results.add_worker() ) );
+        tabulations.back()->fermat_workers = fermat_workers;
+        tabulations.back()->tree_workers = tree_workers;
+    }
+    node_replicas< std::vector< precomputation_job > > all_output_jobs( tree.output_jobs ), all_working_jobs( tree.working_jobs );
+    node_replicas< std::vector< job_primes > > all_output_primes( tree.output_primes ), all_working_primes( tree.working_primes );
+    int numa_nodes = numa ? numa_node_count() : 1;
+    auto work = [&]( uint64_t t )
+    {
+        if( numa ) { numa_pin_thread( numa_worker_node( t, thread_count ) ); }
+        const auto& output_jobs = all_output_jobs.local();
+        const auto& working_jobs = all_working_jobs.local();
+        const auto& output_primes = all_output_primes.local();
+        const auto& working_primes = all_working_primes.local();
+
+        size_t chunk = ( output_jobs.size() + thread_count - 1 ) / thread_count;
+        size_t first = std::min( t*chunk, output_jobs.size() );
+        size_t last = std::min( first + chunk, output_jobs.size() );
+        std::vector< precomputation_job > chunk_jobs( output_jobs.begin() + first, output_jobs.begin() + last );
+        std::vector< job_primes > chunk_primes( output_primes.begin() + first, output_primes.begin() + last );
+        tabulations[t]->run_output_jobs( chunk_jobs, chunk_primes, first );
+        for( size_t i = t; i < working_jobs.size(); i += thread_count )
+        {
+            auto& job = working_jobs[i];
+            tabulations[t]->run_job( job[0], job[1], job[2], working_primes[i], output_jobs.size() + i );
+        }
+        telemetry_merge();
+    };
+    std::vector< std::thread > workers;
+    for( uint64_t t = 1; t < thread_count; t++ ) { workers.emplace_back( work, t ); }
+    work( 0 );
+    for( auto& worker : workers ) { worker.join(); }
+    results.stop();
+    telemetry_write_totals( telemetry_log );
+    shards.clear();
+    if( !output_prefix.empty() ) { std::ofstream( output_prefix + ".txt" ) << pipeline_output.str(); }
+
+    // each line is n followed by its prime factors, which have to multiply to n
+    std::vector< uint64_t > pipeline;
+    uint64_t bad_lines = 0;
+    std::istringstream lines( pipeline_output.str() );
+    std::string line;
+    while( std::getline( lines, line ) )
+    {
+        std::istringstream fields( line );
+        uint64_t n, p, product = 1;
+        fields >> n;
+        while( fields >> p ) { product *= p; }
+        if( product != n ) { bad_lines++; }
+        pipeline.push_back( n );
+    }
+    std::sort( pipeline.begin(), pipeline.end() );
+
+    // the reference
+    auto t2 = std::chrono::steady_clock::now();
+    reference_search reference;
+    reference.run( B );
+    auto t3 = std::chrono::steady_clock::now();
+    std::chrono::duration<double> pipeline_seconds = t2 - t1;
+    std::chrono::duration<double> reference_seconds = t3 - t2;
+
+    std::vector< uint64_t > missing, extra, duplicates;
+    std::set_difference( reference.found.begin(), reference.found.end(), pipeline.begin(), pipeline.end(), std::back_inserter( missing ) );
+    std::set_difference( pipeline.begin(), pipeline.end(), reference.found.begin(), reference.found.end(), std::back_inserter( extra ) );
+    for( size_t i = 1; i < pipeline.size(); i++ )
+    {
+        if( pipeline[i] == pipeline[i-1] ) { duplicates.push_back( pipeline[i] ); }
+    }
+
+    std::cout << "B = 10^" << bound_exponent << " with the elimination rule P*L*" << C_constant << "*p^" << p_exponent << " > B" << std::endl;
+    std::cout << "  " << tree.output_jobs.size() << " output jobs and " << tree.working_jobs.size() << " working jobs on " << thread_count << " threads"
+              << ( numa ? " over " + std::to_string( numa_nodes ) + " NUMA nodes" : "" ) << std::endl;
+    std::cout << "  pipeline:  " << pipeline.size() << " CN in " << pipeline_seconds.count() << " s" << std::endl;
+    std::cout << "  reference: " << reference.found.size() << " CN in " << reference_seconds.count() << " s" << std::endl;
+    std::cout << "  known:     " << known_counts[ bound_exponent ] << " CN" << std::endl;
+
+    for( auto n : missing ) { std::cout << "  missing " << n << std::endl; }
+    for( auto n : extra ) { std::cout << "  extra " << n << std::endl; }
+    for( auto n : duplicates ) { std::cout << "  duplicate " << n << std::endl; }
+    if( bad_lines > 0 ) { std::cout << "  " << bad_lines << " lines whose primes do not multiply to n" << std::endl; }
+    if( reference.disagreements > 0 ) { std::cout << "  appending_is_CN and is_CN disagree " << reference.disagreements << " times" << std::endl; }
+
+    bool passed = missing.empty() && extra.empty() && duplicates.empty() && bad_lines == 0 && reference.disagreements == 0
+               && reference.found.size() == known_counts[ bound_exponent ];
+    std::cout << ( passed ? "PASSED" : "FAILED" ) << std::endl;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,83 @@
+#include "work_stealing.h"
+#include "telemetry.h"
+#include <chrono>
+
+// the deque of the pool thread running this, or of the thread in run
+static thread_local unsigned current_deque = 0;
+
+work_stealing_pool::work_stealing_pool( unsigned init_thread_count )
+{
+    for( unsigned t = 0; t <= init_thread_count; t++ ) { deques.emplace_back( new task_deque ); }
+    for( unsigned t = 1; t <= init_thread_count; t++ ) { threads.emplace_back( &work_stealing_pool::thread_loop, this, t ); }
+}
+
+work_stealing_pool::~work_stealing_pool()
+{
+    stopping.store( true, std::memory_order_release );
+    for( auto& thread : threads ) { thread.join(); }
+}
+
+void work_stealing_pool::run( task first )
+{
+    current_deque = 0;
+    push( first );
+    running.store( true, std::memory_order_release );
+    while( pending.load( std::memory_order_acquire ) > 0 )
+    {
+        if( !run_one( 0 ) ) { std::this_thread::yield(); }
+    }
+    running.store( false, std::memory_order_release );
+}
+
+void work_stealing_pool::push( task next )
+{
+    pending.fetch_add( 1, std::memory_order_acq_rel );
+    task_deque& own = *deques[ current_deque ];
+    std::lock_guard< std::mutex > guard( own.lock );
+    own.tasks.push_back( std::move( next ) );
+}
+
+bool work_stealing_pool::run_one( unsigned t )
+{
+    task next;
+    {
+        task_deque& own = *deques[t];
+        std::lock_guard< std::mutex > guard( own.lock );
+        if( !own.tasks.empty() )
+        {
+            next = std::move( own.tasks.back() );
+            own.tasks.pop_back();
+        }
+    }
+    // steal, starting past t so that the thieves spread out
+    for( unsigned i = 1; !next && i < deques.size(); i++ )
+    {
+        task_deque& other = *deques[ ( t + i ) % deques.size() ];
+        std::lock_guard< std::mutex > guard( other.lock );
+        if( !other.tasks.empty() )
+        {
+            next = std::move( other.tasks.front() );
+            other.tasks.pop_front();
+        }
+    }
+    if( !next ) { return false; }
+    next();
+    pending.fetch_sub( 1, std::memory_order_acq_rel );
+    return true;
+}
+
+void work_stealing_pool::thread_loop( unsigned t )
+{
+    current_deque = t;
+    while( !stopping.load( std::memory_order_acquire ) )
+    {
+        if( !running.load( std::memory_order_acquire ) )
+        {
+            std::this_thread::sleep_for( std::chrono::microseconds( POOL_IDLE_MICROSECONDS ) );
+            continue;
+        }
+        if( !run_one( t ) ) { std::this_thread::yield(); }
+    }
+    // the counts of the tasks this thread ran go to the process totals
+    telemetry_merge();
+}
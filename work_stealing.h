@@ -0,0 +1,61 @@
+#ifndef WORK_STEALING_H
+#define WORK_STEALING_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// a pool of threads for work that is a tree of tasks, e.g. the appending tree of one job, see Tabulation
+// each thread has its own deque of tasks:  it pushes and pops at the back, so it goes depth first
+// on what it made itself, and a thread with none left steals from the front of another's,
+// which in a tree is the oldest and so the biggest piece of work there is
+// a deque is only locked by its owner and a thief at a time, and a task is far longer than the lock
+//
+//   work_stealing_pool pool( 3 );                   // 3 threads besides the one that calls run
+//   pool.run( [&]() { ... pool.push( task ); ... } );  // returns once every task is done
+
+// how long an idle pool thread sleeps between looks for a run
+#define POOL_IDLE_MICROSECONDS 200
+
+class work_stealing_pool
+{
+public:
+    typedef std::function< void() > task;
+
+    work_stealing_pool( unsigned init_thread_count );
+    ~work_stealing_pool();
+    work_stealing_pool( const work_stealing_pool& ) = delete;
+    work_stealing_pool& operator=( const work_stealing_pool& ) = delete;
+
+    // runs first and every task pushed from it, on the pool threads and the calling thread,
+    // and returns once they are all done;  one run at a time
+    void run( task first );
+
+    // queues a task from inside a task of the current run
+    void push( task next );
+
+private:
+    struct task_deque
+    {
+        std::mutex lock;
+        std::deque< task > tasks;
+    };
+
+    // deque 0 belongs to the thread that calls run, deque t to pool thread t
+    std::vector< std::unique_ptr< task_deque > > deques;
+    std::vector< std::thread > threads;
+    std::atomic< uint64_t > pending{ 0 };   // tasks pushed and not yet finished
+    std::atomic< bool > running{ false };
+    std::atomic< bool > stopping{ false };
+
+    void thread_loop( unsigned t );
+    // runs one task of deque t, or one stolen from another, false if there was none
+    bool run_one( unsigned t );
+};
+
+#endif